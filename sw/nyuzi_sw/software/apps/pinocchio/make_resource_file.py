@@ -20,16 +20,25 @@ Read a Wavefront .OBJ file and convert it into a flat file that can be read
 by the viewer program
 """
 
+import argparse
 import math
 import os
 import re
 import struct
 import subprocess
-import sys
 import tempfile
 
 NUM_MIP_LEVELS = 4
 
+# Texture formats. These must match the TextureEntry format field.
+TEXTURE_FORMAT_LINEAR = 0
+TEXTURE_FORMAT_TILED = 1
+TEXTURE_FORMAT_BC1 = 2
+
+# Maximum tile width for tiled textures. This must match kTileSize in
+# librender/Surface.h.
+TILE_SIZE = 64
+
 # This is the final output of the parsing stage
 texture_list = []  # (width, height, data)
 mesh_list = []		# (texture index, vertex list, index list)
@@ -286,22 +295,163 @@ def print_stats():
     print('  z ' + str(minz) + ' ' + str(maxz))
 
 
+def spread_bits(value):
+    value = (value | (value << 4)) & 0x0f0f
+    value = (value | (value << 2)) & 0x3333
+    return (value | (value << 1)) & 0x5555
+
+
+def tile_image(width, height, data):
+    """
+    Convert a linear RGBA image to the layout librender uses for tiled
+    surfaces (see Surface.h): 4x4 pixel blocks in Morton order within
+    contiguous square tiles.
+    """
+    tile_width = TILE_SIZE
+    while tile_width > 4 and (tile_width > width or tile_width > height):
+        tile_width //= 2
+
+    tile_shift = tile_width.bit_length() - 1
+    tile_columns = (width + tile_width - 1) // tile_width
+    tile_rows = (height + tile_width - 1) // tile_width
+    tiled = bytearray(tile_columns * tile_rows * tile_width * tile_width * 4)
+    for y in range(height):
+        for x in range(width):
+            tile_index = (y >> tile_shift) * tile_columns + (x >> tile_shift)
+            block_index = spread_bits((x & (tile_width - 1)) >> 2) | (
+                spread_bits((y & (tile_width - 1)) >> 2) << 1)
+            offset = (tile_index << (tile_shift * 2 + 2)) + block_index * 64 + \
+                ((y & 3) * 4 + (x & 3)) * 4
+            src_offset = (y * width + x) * 4
+            tiled[offset:offset + 4] = data[src_offset:src_offset + 4]
+
+    return bytes(tiled)
+
+
+def pack_rgb565(color):
+    return ((color[0] >> 3) << 11) | ((color[1] >> 2) << 5) | (color[2] >> 3)
+
+
+def unpack_rgb565(packed):
+    red = (packed >> 11) & 31
+    green = (packed >> 5) & 63
+    blue = packed & 31
+    return ((red << 3) | (red >> 2), (green << 2) | (green >> 4),
+            (blue << 3) | (blue >> 2))
+
+
+def color_distance(color1, color2):
+    return sum((a - b) * (a - b) for a, b in zip(color1, color2))
+
+
+def compress_block(texels):
+    """
+    Encode 16 RGB texels as one BC1 block. This uses the corners of the
+    bounding box of the colors as endpoints.
+    """
+    color0 = pack_rgb565(tuple(max(texel[c] for texel in texels)
+                               for c in range(3)))
+    color1 = pack_rgb565(tuple(min(texel[c] for texel in texels)
+                               for c in range(3)))
+    if color0 == color1:
+        # Three color mode with every texel using the first endpoint
+        return struct.pack('<HHI', color0, color1, 0)
+
+    if color0 < color1:
+        color0, color1 = color1, color0
+
+    endpoint0 = unpack_rgb565(color0)
+    endpoint1 = unpack_rgb565(color1)
+    palette = [endpoint0, endpoint1,
+               tuple((2 * a + b) // 3 for a, b in zip(endpoint0, endpoint1)),
+               tuple((a + 2 * b) // 3 for a, b in zip(endpoint0, endpoint1))]
+    indices = 0
+    for texel_index, texel in enumerate(texels):
+        distances = [color_distance(texel, entry) for entry in palette]
+        indices |= distances.index(min(distances)) << (texel_index * 2)
+
+    return struct.pack('<HHI', color0, color1, indices)
+
+
+def compress_image(width, height, data):
+    """
+    Convert a linear RGBA image to BC1 blocks, stored in rows of blocks.
+    """
+    blocks = []
+    for block_y in range(0, height, 4):
+        for block_x in range(0, width, 4):
+            texels = []
+            for y in range(block_y, block_y + 4):
+                for x in range(block_x, block_x + 4):
+                    offset = (y * width + x) * 4
+                    texels.append(tuple(data[offset:offset + 3]))
+
+            blocks.append(compress_block(texels))
+
+    return b''.join(blocks)
+
+
+def is_opaque(data):
+    return all(alpha == 255 for alpha in data[3::4])
+
+
+def encode_texture(width, height, data, allow_compression):
+    """
+    Convert all mip levels of a texture to BC1 (if allowed and the texture
+    is opaque) or tiled layout, if their sizes allow it. Returns
+    (format, data)
+    """
+    if allow_compression and is_opaque(data):
+        texture_format = TEXTURE_FORMAT_BC1
+        encode_level = compress_image
+    else:
+        texture_format = TEXTURE_FORMAT_TILED
+        encode_level = tile_image
+
+    levels = []
+    offset = 0
+    for level in range(NUM_MIP_LEVELS + 1):
+        level_width = width >> level
+        level_height = height >> level
+        if level_width % 4 != 0 or level_height % 4 != 0:
+            return TEXTURE_FORMAT_LINEAR, data
+
+        size = level_width * level_height * 4
+        levels.append(encode_level(level_width, level_height,
+                                   data[offset:offset + size]))
+        offset += size
+
+    return texture_format, b''.join(levels)
+
+
 def align(addr, alignment):
     return int((addr + alignment - 1) // alignment) * alignment
 
 
-def write_resource_file(filename):
+def mesh_bounds(vertices):
+    """
+    Return the minimum and maximum position of the vertices in a mesh, which
+    the viewer uses to skip meshes that are outside the view.
+    """
+    return ([min(vert[axis] for vert in vertices) for axis in range(3)],
+            [max(vert[axis] for vert in vertices) for axis in range(3)])
+
+
+def write_resource_file(filename, allow_compression):
     current_data_offset = 12 + len(texture_list) * \
-        12 + len(mesh_list) * 16  # Skip header
+        12 + len(mesh_list) * 40  # Skip header
     current_header_offset = 12
 
     with open(filename, 'wb') as f:
         # Write textures
         for width, height, data in texture_list:
+            texture_format, data = encode_texture(width, height, data,
+                                                  allow_compression)
+
             # Write file header
             f.seek(current_header_offset)
-            f.write(struct.pack('iihh', current_data_offset,
-                                NUM_MIP_LEVELS, width, height))
+            f.write(struct.pack('iHHhh', current_data_offset,
+                                NUM_MIP_LEVELS, texture_format, width, height))
             current_header_offset += 12
 
             # Write data
@@ -314,10 +464,12 @@ def write_resource_file(filename):
             current_data_offset = align(current_data_offset, 4)
 
             # Write file header
+            bounds_min, bounds_max = mesh_bounds(vertices)
             f.seek(current_header_offset)
-            f.write(struct.pack('iiii', current_data_offset,
-                                texture_idx, len(vertices), len(indices)))
-            current_header_offset += 16
+            f.write(struct.pack('iiii6f', current_data_offset,
+                                texture_idx, len(vertices), len(indices),
+                                *(bounds_min + bounds_max)))
+            current_header_offset += 40
 
             # Write data
             f.seek(current_data_offset)
@@ -339,10 +491,12 @@ def write_resource_file(filename):
         print('wrote ' + filename)
 
 # Main
-if len(sys.argv) < 2:
-    print('enter the name of a .OBJ file')
-    sys.exit(1)
+parser = argparse.ArgumentParser(description='Convert an .OBJ file to a resource file')
+parser.add_argument('obj_file', help='name of a .OBJ file')
+parser.add_argument('--bc1', action='store_true',
+                    help='compress opaque textures with BC1 (4 bits per pixel)')
+args = parser.parse_args()
 
-read_obj_file(sys.argv[1])
+read_obj_file(args.obj_file)
 print_stats()
-write_resource_file('resource.bin')
+write_resource_file('resource.bin', args.bc1)
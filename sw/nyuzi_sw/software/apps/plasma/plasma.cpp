@@ -19,9 +19,9 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <schedule.h>
+#include <sync.h>
 #include <time.h>
 #include <vga.h>
-#include "Barrier.h"
 
 //
 // Sum-of-sines demo style plasma effect
@@ -139,7 +139,7 @@ vecf16_t slow_sqrtfv(vecf16_t value)
 #define NUM_PALETTE_ENTRIES 512
 
 int gFrameNum = 0;
-Barrier<4> gFrameBarrier;
+barrier gFrameBarrier = BARRIER_INIT(4);
 uint32_t gPalette[NUM_PALETTE_ENTRIES];
 volatile int gThreadId = 0;
 
@@ -208,7 +208,7 @@ int main()
             }
         }
 
-        gFrameBarrier.wait();
+        barrier_wait(&gFrameBarrier);
     }
 
     return 0;
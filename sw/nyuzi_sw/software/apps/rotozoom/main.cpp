@@ -18,9 +18,9 @@
 #include <schedule.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sync.h>
 #include <time.h>
 #include <vga.h>
-#include "Barrier.h"
 #include "image.h"
 #include "Matrix2x2.h"
 
@@ -36,7 +36,7 @@ const int kBytesPerPixel = 4;
 const int kScreenWidth = 640;
 const int kScreenHeight = 480;
 
-Barrier<4> gFrameBarrier;
+barrier gFrameBarrier = BARRIER_INIT(4);
 Matrix2x2 displayMatrix;
 
 int main() { 
@@ -106,7 +106,7 @@ int main() {
                 frameNum = 0;
             }
         }
-        gFrameBarrier.wait();
+        barrier_wait(&gFrameBarrier);
     }
     if (myThreadId == 0) {
         printf("Bye!\n\r\n\r");
@@ -18,9 +18,9 @@
 #include <schedule.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sync.h>
 #include <time.h>
 #include <vga.h>
-#include "Barrier.h"
 #include "image.h"
 #include "Matrix2x2.h"
 
@@ -47,7 +47,7 @@ const int kBytesPerPixel = 4;
 const int kScreenWidth = 640;
 const int kScreenHeight = 480;
 
-Barrier<4> gFrameBarrier;
+barrier gFrameBarrier = BARRIER_INIT(4);
 Matrix2x2 displayMatrix;
 
 volatile uint32_t *fb = (uint32_t *)(0x15000000);
@@ -171,7 +171,7 @@ int main()
         }
 
 
-        gFrameBarrier.wait();
+        barrier_wait(&gFrameBarrier);
     }
 
     return 0;
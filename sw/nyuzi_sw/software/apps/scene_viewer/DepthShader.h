@@ -18,7 +18,7 @@
 #define __DEPTH_SHADER_H
 
 #include <Matrix.h>
-#include <Shader.h>
+#include <SpecializedShader.h>
 
 using namespace librender;
 
@@ -28,14 +28,9 @@ struct DepthUniforms
 };
 
 // Represents depth as a brightness
-class DepthShader : public Shader
+class DepthShader : public SpecializedShader<DepthShader, 8, 5>
 {
 public:
-    DepthShader()
-        :	Shader(8, 5)
-    {
-    }
-
     void shadeVertices(vecf16_t *outParams, const vecf16_t *inAttribs, const void *_uniforms,
                        vmask_t) const override
     {
@@ -0,0 +1,56 @@
+//
+// Copyright 2011-2015 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#ifndef __PROXY_SHADER_H
+#define __PROXY_SHADER_H
+
+#include <Matrix.h>
+#include <SpecializedShader.h>
+
+using namespace librender;
+
+struct ProxyUniforms
+{
+    Matrix fMVPMatrix;
+};
+
+// Transforms the corners of a bounding box for occlusion queries. These
+// draw calls don't write color, so shadePixels is never called.
+class ProxyShader : public SpecializedShader<ProxyShader, 3, 4>
+{
+public:
+    void shadeVertices(vecf16_t *outParams, const vecf16_t *inAttribs, const void *_uniforms,
+                       vmask_t) const override
+    {
+        const ProxyUniforms *uniforms = static_cast<const ProxyUniforms*>(_uniforms);
+        vecf16_t coord[4];
+        for (int i = 0; i < 3; i++)
+            coord[i] = inAttribs[i];
+
+        coord[3] = 1.0f;
+        uniforms->fMVPMatrix.mulVec(outParams, coord);
+    }
+
+    void shadePixels(vecf16_t *outColor, const vecf16_t *, const void *,
+                     const Texture * const *, vmask_t) const override
+    {
+        for (int channel = 0; channel < 4; channel++)
+            outColor[channel] = 1.0f;
+    }
+};
+
+#endif
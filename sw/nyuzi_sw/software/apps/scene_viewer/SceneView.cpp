@@ -11,9 +11,24 @@
 // Offset for distance to object from the camera
 #define CAMERA_DISTANCE_OFFSET 6
 
-float getFloatIndex(const void *ptr, unsigned int index) {
-    return *((float *)(ptr) + index);
-}
+// Bounding boxes closer than this to the camera may be cut off by the near
+// clipping plane, so their occlusion queries skip the depth test.
+#define PROXY_NEAR_MARGIN 2.0f
+
+// Bounding boxes are enlarged by this much, so flat meshes, which lie in
+// a face of their box, don't hide their own box.
+#define PROXY_BOX_MARGIN 0.05f
+
+// Triangles for the faces of a bounding box. Corner i has the maximum x
+// coordinate if bit 0 is set, maximum y for bit 1, and maximum z for bit 2.
+static const int kBoxIndices[36] = {
+    0, 2, 6, 0, 6, 4,   // -x
+    1, 3, 7, 1, 7, 5,   // +x
+    0, 1, 5, 0, 5, 4,   // -y
+    2, 3, 7, 2, 7, 6,   // +y
+    0, 1, 3, 0, 3, 2,   // -z
+    4, 5, 7, 4, 7, 6    // +z
+};
 
 /**
  * @brief       The default constructor which initializes member variables
@@ -54,12 +69,17 @@ void SceneView::start() {
         textures[textureIndex] = new Texture();
         textures[textureIndex]->enableBilinearFiltering(true);
         int offset = texture_header[textureIndex].offset;
+        uint16_t textureFormat = texture_header[textureIndex].format;
+        Surface::Layout layout = textureFormat == TEXTURE_FORMAT_TILED
+                                    ? Surface::kTiled : Surface::kLinear;
+        Surface::Format format = textureFormat == TEXTURE_FORMAT_BC1
+                                    ? Surface::kBC1 : Surface::kRGBA8888;
         for (unsigned int mipLevel = 0; mipLevel < texture_header[textureIndex].mipLevels; mipLevel++) {
             int width = texture_header[textureIndex].width >> mipLevel;
             int height = texture_header[textureIndex].height >> mipLevel;
-            Surface *surface = new Surface(width, height, resource_file + offset);
+            Surface *surface = new Surface(width, height, resource_file + offset, layout, format);
             textures[textureIndex]->setMipSurface(mipLevel, surface);
-            offset += width * height * 4;
+            offset += Surface::getAllocationSize(width, height, layout, format);
         }
     }
 
@@ -71,31 +91,6 @@ void SceneView::start() {
         const MeshEntry &entry = mesh_header[meshIndex];
         vertexBuffers[meshIndex].setData(resource_file + entry.offset,
                                             entry.numVertices, sizeof(float) * kAttrsPerVertex);
-
-        // Iterate over alle vertices in mesh to find lowest and highest x,y,z
-        for (unsigned int i = 0; i < entry.numVertices; i++) {
-            float x = getFloatIndex(vertexBuffers[meshIndex].getData(), 8*i + 0);
-            float y = getFloatIndex(vertexBuffers[meshIndex].getData(), 8*i + 1);
-            float z = getFloatIndex(vertexBuffers[meshIndex].getData(), 8*i + 2);
-            if (x < fXmin) {
-                fXmin = x;
-            }
-            if (x > fXmax) {
-                fXmax = x;
-            }
-            if (y < fYmin) {
-                fYmin = y;
-            }
-            if (y > fYmax) {
-                fYmax = y;
-            }
-            if (z < fZmin) {
-                fZmin = z;
-            }
-            if (z > fZmax) {
-                fZmax = z;
-            }
-        }
         indexBuffers[meshIndex].setData(resource_file + entry.offset + entry.numVertices
                             * kAttrsPerVertex * sizeof(float), entry.numIndices, sizeof(int));
     }
@@ -111,7 +106,7 @@ void SceneView::start() {
     // Creeate the render target and bind it to the first framebuffer
     context      = new RenderContext(0x1000000); // TODO describe this address
     renderTarget = new RenderTarget();
-    depthBuffer  = new Surface(FB_WIDTH, FB_HEIGHT);
+    depthBuffer  = new Surface(FB_WIDTH, FB_HEIGHT, Surface::kTiled);
     colorBuffer1 = new Surface(FB_WIDTH, FB_HEIGHT, pFrameBuffer1);
     colorBuffer2 = new Surface(FB_WIDTH, FB_HEIGHT, pFrameBuffer2);
     colorBuffer3 = new Surface(FB_WIDTH, FB_HEIGHT, pFrameBuffer3);
@@ -122,6 +117,65 @@ void SceneView::start() {
     context->enableDepthBuffer(true);
     context->bindShader(new TextureShader());
     context->setClearColor(0.52, 0.80, 0.98);
+
+    // Each mesh has an occlusion query, which render() fills by drawing
+    // the mesh's bounding box after the scene.
+    meshQueries = new OcclusionQuery[resource_header->numMeshes];
+    proxyVertices = new float[resource_header->numMeshes * 24];
+    proxyVertexBuffers = new RenderBuffer[resource_header->numMeshes];
+    for (unsigned int meshIndex = 0; meshIndex < resource_header->numMeshes; meshIndex++) {
+        const MeshEntry &entry = mesh_header[meshIndex];
+        float *corners = proxyVertices + meshIndex * 24;
+        for (int corner = 0; corner < 8; corner++) {
+            for (int axis = 0; axis < 3; axis++) {
+                corners[corner * 3 + axis] = (corner & (1 << axis))
+                                             ? entry.boundsMax[axis] + PROXY_BOX_MARGIN
+                                             : entry.boundsMin[axis] - PROXY_BOX_MARGIN;
+            }
+        }
+
+        proxyVertexBuffers[meshIndex].setData(corners, 8, sizeof(float) * 3);
+    }
+
+    proxyIndexBuffer = new RenderBuffer(kBoxIndices, 36, sizeof(int));
+
+    // Record the draw calls for all meshes once. Only the matrices change
+    // between frames, so render() patches them and replays the buffer.
+    sceneCommands = new CommandBuffer(0x100000);
+    context->beginCommandBuffer(sceneCommands);
+    for (unsigned int meshIndex = 0; meshIndex < resource_header->numMeshes; meshIndex++) {
+        const MeshEntry &entry = mesh_header[meshIndex];
+        if (entry.textureId != 0xffffffff) {
+            assert(entry.textureId < resource_header->numTextures);
+            context->bindTexture(0, textures[entry.textureId]);
+            uniforms.fHasTexture = true;
+        }
+        else {
+            uniforms.fHasTexture = false;
+        }
+
+        // The bounding box is tested against the view each time the buffer
+        // is executed, so meshes that are outside it, or that were hidden
+        // in the last frame, are skipped before any of their vertices are
+        // shaded.
+        context->bindUniforms(&uniforms, sizeof(uniforms));
+        context->bindVertexAttrs(&vertexBuffers[meshIndex]);
+        context->drawElementsConditional(&indexBuffers[meshIndex], &meshQueries[meshIndex],
+                                         Vec3(entry.boundsMin[0], entry.boundsMin[1],
+                                              entry.boundsMin[2]),
+                                         Vec3(entry.boundsMax[0], entry.boundsMax[1],
+                                              entry.boundsMax[2]),
+                                         Matrix());
+    }
+
+    context->endCommandBuffer();
+
+    // The bounding boxes only update the queries. They don't write any
+    // pixels, and both sides are drawn in case the camera is inside.
+    context->bindShader(new ProxyShader());
+    context->enableColorWrite(false);
+    context->enableDepthWrite(false);
+    context->setCulling(RenderState::kCullNone);
 }
 
 /**
@@ -163,21 +217,36 @@ uint64_t SceneView::render() {
         // Write to first framebuffer
         renderTarget->setColorBuffer(colorBuffer1);
     }
+    // finish() has completed the previous frame, so the command buffer can
+    // be patched.
+    sceneCommands->patchUniforms(offsetof(TextureUniforms, fMVPMatrix), &uniforms.fMVPMatrix,
+                                 sizeof(Matrix));
+    sceneCommands->patchUniforms(offsetof(TextureUniforms, fNormalMatrix),
+                                 &uniforms.fNormalMatrix, sizeof(Matrix));
     context->clearColorBuffer();
+    context->executeCommandBuffer(sceneCommands, &uniforms.fMVPMatrix);
+
+    // Test the bounding box of each mesh against the finished scene, to
+    // find out which meshes the next frame can skip.
+    ProxyUniforms proxyUniforms;
+    proxyUniforms.fMVPMatrix = uniforms.fMVPMatrix;
+    context->bindUniforms(&proxyUniforms, sizeof(proxyUniforms));
     for (unsigned int meshIndex = 0; meshIndex < resource_header->numMeshes; meshIndex++) {
         const MeshEntry &entry = mesh_header[meshIndex];
-        if (entry.textureId != 0xffffffff) {
-            assert(entry.textureId < resource_header->numTextures);
-            context->bindTexture(0, textures[entry.textureId]);
-            uniforms.fHasTexture = true;
-        }
-        else {
-            uniforms.fHasTexture = false;
+        bool nearCamera = true;
+        for (int axis = 0; axis < 3; axis++) {
+            if (lookAtArgs.vLocation[axis] < entry.boundsMin[axis] - PROXY_NEAR_MARGIN
+                    || lookAtArgs.vLocation[axis] > entry.boundsMax[axis] + PROXY_NEAR_MARGIN)
+                nearCamera = false;
         }
 
-        context->bindUniforms(&uniforms, sizeof(uniforms));
-        context->bindVertexAttrs(&vertexBuffers[meshIndex]);
-        context->drawElements(&indexBuffers[meshIndex]);
+        // If the near plane cuts off the front of the box, the back may be
+        // hidden by the mesh itself. Count every pixel instead.
+        context->enableDepthBuffer(!nearCamera);
+        context->beginQuery(&meshQueries[meshIndex]);
+        context->bindVertexAttrs(&proxyVertexBuffers[meshIndex]);
+        context->drawElements(proxyIndexBuffer);
+        context->endQuery();
     }
 
     clock_t startTime = clock();
@@ -10,17 +10,19 @@
 #define __SCENE_VIEW_H
 
 #include <nyuzi.h>
+#include <CommandBuffer.h>
 #include <RenderContext.h>
 #include <schedule.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <time.h>
 #include <vga.h>
 #include <Surface.h>
 #include "DepthShader.h"
+#include "ProxyShader.h"
 #include "schedule.h"
 #include "TextureShader.h"
 #include "shared_mem_itf.h"
-#include <float.h>
 
 struct FileHeader {
     uint32_t fileSize;
@@ -30,16 +32,25 @@ struct FileHeader {
 
 struct TextureEntry {
     uint32_t offset;
-    uint32_t mipLevels;
+    uint16_t mipLevels;
+    uint16_t format;    // see TextureFormat
     uint16_t width;
     uint16_t height;
 };
 
+enum TextureFormat {
+    TEXTURE_FORMAT_LINEAR,  // RGBA8888
+    TEXTURE_FORMAT_TILED,   // RGBA8888, Surface::kTiled
+    TEXTURE_FORMAT_BC1      // 4 bits per pixel compressed
+};
+
 struct MeshEntry {
     uint32_t offset;
     uint32_t textureId;
     uint32_t numVertices;
     uint32_t numIndices;
+    float boundsMin[3];     // Object space bounding box of the vertices
+    float boundsMax[3];
 };
 
 struct LookAtArguments {
@@ -94,6 +105,11 @@ private:
     RenderBuffer *vertexBuffers;
     RenderBuffer *indexBuffers;
     RenderContext *context;
+    CommandBuffer *sceneCommands;   // Draw calls for all meshes, recorded once
+    OcclusionQuery *meshQueries;    // Whether each mesh was visible in the last frame
+    float *proxyVertices;           // Bounding box corners of each mesh
+    RenderBuffer *proxyVertexBuffers;
+    RenderBuffer *proxyIndexBuffer;
     RenderTarget *renderTarget;
     Matrix modelViewMatrix;
     Surface *depthBuffer;        
@@ -106,12 +122,6 @@ private:
     float fPsi;
     dir_t eRotateDirection;
     LookAtArguments lookAtArgs;
-    float fXmin = FLT_MAX;
-    float fYmin = FLT_MAX;
-    float fZmin = FLT_MAX;
-    float fXmax = FLT_MIN;
-    float fYmax = FLT_MIN;
-    float fZmax = FLT_MIN;
     fb_t eCurrentRenderFB = FB_1;
 };
 
@@ -18,8 +18,8 @@
 #pragma once
 
 #include <Matrix.h>
-#include <Shader.h>
 #include <SIMDMath.h>
+#include <SpecializedShader.h>
 #include <Texture.h>
 
 using namespace librender;
@@ -34,14 +34,9 @@ struct TextureUniforms
     float fDirectional;
 };
 
-class TextureShader : public Shader
+class TextureShader : public SpecializedShader<TextureShader, 8, 9>
 {
 public:
-    TextureShader()
-        :	Shader(8, 9)
-    {
-    }
-
     void shadeVertices(vecf16_t *outParams, const vecf16_t *inAttribs, const void *_uniforms,
                        vmask_t) const override
     {
@@ -16,8 +16,8 @@
 
 #pragma once
 
-#include <Shader.h>
 #include <SIMDMath.h>
+#include <SpecializedShader.h>
 
 using namespace librender;
 
@@ -40,14 +40,9 @@ struct OutputUniforms
 // The Output shader interpolates  normals across the surface of the triangle
 // and computes the dot product at each pixel
 //
-class OutputShader : public Shader
+class OutputShader : public SpecializedShader<OutputShader, 6, 12>
 {
 public:
-    OutputShader()
-        :	Shader(6, 12)
-    {
-    }
-
     void shadeVertices(vecf16_t *outParams, const vecf16_t *inAttribs, const void *_uniforms,
                        vmask_t) const override
     {
@@ -101,9 +96,9 @@ public:
         sampler[0]->readPixels(inParams[4] * 0.5 + 0.5, inParams[5] * 0.5 + 0.5, mask,
             shadowMapValue);
 #if ENABLE_SHADOW
-        // The multiplier here must be the inverse of the one in
-        // ShadowMapShader.
-        vecf16_t depth = -shadowMapValue[0] * 10;
+        // The shadow map holds the light space depth of the nearest
+        // surface to the light.
+        vecf16_t depth = shadowMapValue[0];
         vmask_t inShadow = __builtin_nyuzi_mask_cmpf_gt(depth - inParams[6],
             (vecf16_t) kShadowBias);
 #else
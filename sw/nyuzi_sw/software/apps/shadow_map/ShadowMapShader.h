@@ -18,7 +18,7 @@
 #define __DEPTH_SHADER_H
 
 #include <Matrix.h>
-#include <Shader.h>
+#include <SpecializedShader.h>
 
 using namespace librender;
 
@@ -27,15 +27,12 @@ struct ShadowMapUniforms
     Matrix fMVPMatrix;
 };
 
-// Represents depth as a brightness
-class ShadowMapShader : public Shader
+// Transforms vertices into light space. The shadow map target only has a
+// depth buffer, so shadePixels is only used when viewing the scene from the
+// light with SHOW_SHADOW_MAP, where it represents depth as a brightness.
+class ShadowMapShader : public SpecializedShader<ShadowMapShader, 8, 5>
 {
 public:
-    ShadowMapShader()
-        :	Shader(8, 5)
-    {
-    }
-
     void shadeVertices(vecf16_t *outParams, const vecf16_t *inAttribs, const void *_uniforms,
                        vmask_t) const override
     {
@@ -57,7 +54,7 @@ public:
                      const void *, const Texture * const * ,
                      vmask_t) const override
     {
-        // Need to squeeze value into 0.0-1.0 to fit in texture
+        // Squeeze value into 0.0-1.0 to make it visible.
         // The 0.1 is arbitrary and probably depends on the scene.
         vecf16_t depthval = -inParams[0] * 0.1;
         outColor[kColorR] = depthval;
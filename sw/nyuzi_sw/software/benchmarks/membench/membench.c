@@ -24,6 +24,7 @@
 #include <schedule.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sync.h>
 
 #define NUM_THREADS 4
 #define LOOP_UNROLL 16
@@ -31,20 +32,20 @@
 const int TRANSFER_SIZE = 0x200000;
 void * const region_1_base = (void*) 0x200000;
 void * const region_2_base = (void*) (region_1_base + TRANSFER_SIZE);
-volatile int active_thread_count = 0;
+struct barrier parallel_barrier = BARRIER_INIT(NUM_THREADS);
 
+// end_parallel halts the other threads, which continue where they stopped
+// when thread 0 starts the next test. The barrier makes sure all of them have
+// caught up before the timed section starts.
 void start_parallel(void)
 {
     start_all_threads();
-    __sync_fetch_and_add(&active_thread_count, 1);
+    barrier_wait(&parallel_barrier);
 }
 
 void end_parallel(void)
 {
-    __sync_fetch_and_add(&active_thread_count, -1);
-    while (active_thread_count > 0)
-        ;
-
+    barrier_wait(&parallel_barrier);
     if (get_current_thread_id() == 0)
     {
         // Stop all but me
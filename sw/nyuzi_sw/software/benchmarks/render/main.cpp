@@ -0,0 +1,315 @@
+//
+// Copyright 2011-2015 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+//
+// Renders the resource files of the demo scenes headlessly along a fixed
+// camera path, and prints cycles per frame, a breakdown by phase, and
+// triangle throughput for each scene. There is no VGA dependency, so this
+// runs unchanged in the emulator and in Verilog simulation. Output lines
+// that start with "render," are comma separated values, which scripts can
+// collect to track performance over time.
+//
+
+#include <math.h>
+#include <nyuzi.h>
+#include <RenderContext.h>
+#include <RenderTarget.h>
+#include <schedule.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "TextureShader.h"
+
+using namespace librender;
+
+namespace
+{
+
+// Layout of the files that make_resource_file.py writes.
+struct FileHeader
+{
+    uint32_t fileSize;
+    uint32_t numTextures;
+    uint32_t numMeshes;
+};
+
+struct TextureEntry
+{
+    uint32_t offset;
+    uint16_t mipLevels;
+    uint16_t format;
+    uint16_t width;
+    uint16_t height;
+};
+
+enum TextureFormat
+{
+    TEXTURE_FORMAT_LINEAR,
+    TEXTURE_FORMAT_TILED,
+    TEXTURE_FORMAT_BC1
+};
+
+struct MeshEntry
+{
+    uint32_t offset;
+    uint32_t textureId;
+    uint32_t numVertices;
+    uint32_t numIndices;
+    float boundsMin[3];
+    float boundsMax[3];
+};
+
+const char * const kSceneFiles[] =
+{
+    "cup.bin",
+    "pinocchio.bin",
+    "pyramide.bin",
+    "luigi.bin",
+    "sponza.bin"
+};
+
+const int kNumScenes = sizeof(kSceneFiles) / sizeof(kSceneFiles[0]);
+const int kAttrsPerVertex = 8;
+const int kWarmupFrames = 1;
+const int kMeasuredFrames = 8;
+const float kInfinity = __builtin_inff();
+
+// The camera orbits the scene at this multiple of the radius of its
+// bounding box, a little above its center.
+const float kOrbitDistance = 1.2f;
+const float kOrbitHeight = 0.3f;
+
+char *readResourceFile(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("couldn't open %s\n", filename);
+        return nullptr;
+    }
+
+    FileHeader header;
+    if (read(fd, &header, sizeof(header)) != sizeof(header))
+    {
+        printf("couldn't read header of %s\n", filename);
+        close(fd);
+        return nullptr;
+    }
+
+    // Textures in the file are aligned for vector loads
+    char *data = static_cast<char*>(memalign(64, header.fileSize));
+    lseek(fd, 0, SEEK_SET);
+    if (read(fd, data, header.fileSize) != static_cast<int>(header.fileSize))
+    {
+        printf("couldn't read %s\n", filename);
+        free(data);
+        close(fd);
+        return nullptr;
+    }
+
+    close(fd);
+    return data;
+}
+
+void accumulateStats(FrameStats &total, const FrameStats &frame)
+{
+    total.vertexCycles += frame.vertexCycles;
+    total.setUpCycles += frame.setUpCycles;
+    total.sortCycles += frame.sortCycles;
+    total.pixelCycles += frame.pixelCycles;
+    total.fillCycles += frame.fillCycles;
+    total.flushCycles += frame.flushCycles;
+    total.geometryL2Misses += frame.geometryL2Misses;
+    total.pixelL2Misses += frame.pixelL2Misses;
+    total.numTriangles += frame.numTriangles;
+    total.numBinnedTriangles += frame.numBinnedTriangles;
+}
+
+void runScene(const char *filename, RenderContext *context, RenderTarget *target,
+              Shader *shader)
+{
+    char *resourceFile = readResourceFile(filename);
+    if (resourceFile == nullptr)
+        return;
+
+    const FileHeader *fileHeader = reinterpret_cast<const FileHeader*>(resourceFile);
+    const TextureEntry *textureEntries = reinterpret_cast<const TextureEntry*>(
+        resourceFile + sizeof(FileHeader));
+    const MeshEntry *meshEntries = reinterpret_cast<const MeshEntry*>(
+        resourceFile + sizeof(FileHeader) + fileHeader->numTextures * sizeof(TextureEntry));
+
+    Texture **textures = new Texture*[fileHeader->numTextures];
+    Surface **mipSurfaces = new Surface*[fileHeader->numTextures * kMaxMipLevels];
+    int numMipSurfaces = 0;
+    for (unsigned int textureIndex = 0; textureIndex < fileHeader->numTextures; textureIndex++)
+    {
+        const TextureEntry &entry = textureEntries[textureIndex];
+        Surface::Layout layout = entry.format == TEXTURE_FORMAT_TILED ? Surface::kTiled
+                                 : Surface::kLinear;
+        Surface::Format format = entry.format == TEXTURE_FORMAT_BC1 ? Surface::kBC1
+                                 : Surface::kRGBA8888;
+        textures[textureIndex] = new Texture();
+        textures[textureIndex]->enableBilinearFiltering(true);
+        unsigned int offset = entry.offset;
+        for (int mipLevel = 0; mipLevel < entry.mipLevels; mipLevel++)
+        {
+            int width = entry.width >> mipLevel;
+            int height = entry.height >> mipLevel;
+            Surface *surface = new Surface(width, height, resourceFile + offset, layout, format);
+            mipSurfaces[numMipSurfaces++] = surface;
+            textures[textureIndex]->setMipSurface(mipLevel, surface);
+            offset += Surface::getAllocationSize(width, height, layout, format);
+        }
+    }
+
+    RenderBuffer *vertexBuffers = new RenderBuffer[fileHeader->numMeshes];
+    RenderBuffer *indexBuffers = new RenderBuffer[fileHeader->numMeshes];
+    Vec3 sceneMin(kInfinity, kInfinity, kInfinity);
+    Vec3 sceneMax(-kInfinity, -kInfinity, -kInfinity);
+    for (unsigned int meshIndex = 0; meshIndex < fileHeader->numMeshes; meshIndex++)
+    {
+        const MeshEntry &entry = meshEntries[meshIndex];
+        vertexBuffers[meshIndex].setData(resourceFile + entry.offset, entry.numVertices,
+                                         sizeof(float) * kAttrsPerVertex);
+        indexBuffers[meshIndex].setData(resourceFile + entry.offset + entry.numVertices
+                                        * kAttrsPerVertex * sizeof(float), entry.numIndices,
+                                        sizeof(int));
+        for (int axis = 0; axis < 3; axis++)
+        {
+            sceneMin[axis] = min(sceneMin[axis], entry.boundsMin[axis]);
+            sceneMax[axis] = max(sceneMax[axis], entry.boundsMax[axis]);
+        }
+    }
+
+    Vec3 center = (sceneMin + sceneMax) * 0.5f;
+    float radius = (sceneMax - sceneMin).magnitude() * 0.5f;
+    Matrix projectionMatrix = Matrix::getProjectionMatrix(FB_WIDTH, FB_HEIGHT);
+    TextureUniforms uniforms;
+    uniforms.fLightDirection = Vec3(-1, -0.5, 1).normalized();
+    uniforms.fDirectional = 0.5f;
+    uniforms.fAmbient = 0.4f;
+
+    context->bindTarget(target);
+    context->bindShader(shader);
+    FrameStats total;
+    unsigned int startCycles = 0;
+    clock_t startTime = 0;
+    for (int frame = 0; frame < kWarmupFrames + kMeasuredFrames; frame++)
+    {
+        if (frame == kWarmupFrames)
+        {
+            startCycles = get_cycle_count();
+            startTime = clock();
+        }
+
+        float angle = static_cast<float>(frame) * 2.0f * static_cast<float>(M_PI)
+                      / (kWarmupFrames + kMeasuredFrames);
+        Vec3 location = center + Vec3(sinf(angle) * radius * kOrbitDistance,
+                                      radius * kOrbitHeight,
+                                      cosf(angle) * radius * kOrbitDistance);
+        Matrix modelViewMatrix = Matrix::lookAt(location, center, Vec3(0, 1, 0));
+        uniforms.fMVPMatrix = projectionMatrix * modelViewMatrix;
+        uniforms.fNormalMatrix = modelViewMatrix.upper3x3();
+        context->clearColorBuffer();
+        for (unsigned int meshIndex = 0; meshIndex < fileHeader->numMeshes; meshIndex++)
+        {
+            const MeshEntry &entry = meshEntries[meshIndex];
+            uniforms.fHasTexture = entry.textureId != 0xffffffff;
+            if (uniforms.fHasTexture)
+                context->bindTexture(0, textures[entry.textureId]);
+
+            context->bindUniforms(&uniforms, sizeof(uniforms));
+            context->bindVertexAttrs(&vertexBuffers[meshIndex]);
+            context->drawElements(&indexBuffers[meshIndex],
+                                  Vec3(entry.boundsMin[0], entry.boundsMin[1],
+                                       entry.boundsMin[2]),
+                                  Vec3(entry.boundsMax[0], entry.boundsMax[1],
+                                       entry.boundsMax[2]),
+                                  uniforms.fMVPMatrix);
+        }
+
+        context->finish();
+        if (frame >= kWarmupFrames)
+            accumulateStats(total, context->getFrameStats());
+    }
+
+    unsigned int elapsedCycles = get_cycle_count() - startCycles;
+    float elapsedSeconds = static_cast<float>(clock() - startTime) / CLOCKS_PER_SEC;
+    printf("render,%s,%d,%u,%u,%u,%u,%u,%u,%u,%u,%u,%d,%d,%g\n", filename, kMeasuredFrames,
+           elapsedCycles / kMeasuredFrames,
+           total.vertexCycles / kMeasuredFrames,
+           total.setUpCycles / kMeasuredFrames,
+           total.sortCycles / kMeasuredFrames,
+           total.pixelCycles / kMeasuredFrames,
+           total.fillCycles / kMeasuredFrames,
+           total.flushCycles / kMeasuredFrames,
+           total.geometryL2Misses / kMeasuredFrames,
+           total.pixelL2Misses / kMeasuredFrames,
+           static_cast<unsigned int>(context->getWorkingMemHighWaterMark()),
+           total.numTriangles / kMeasuredFrames,
+           total.numBinnedTriangles / kMeasuredFrames,
+           static_cast<float>(total.numTriangles) / elapsedSeconds);
+
+    for (int i = 0; i < numMipSurfaces; i++)
+        delete mipSurfaces[i];
+
+    for (unsigned int textureIndex = 0; textureIndex < fileHeader->numTextures; textureIndex++)
+        delete textures[textureIndex];
+
+    delete [] mipSurfaces;
+    delete [] textures;
+    delete [] vertexBuffers;
+    delete [] indexBuffers;
+    free(resourceFile);
+}
+
+} // namespace
+
+// All threads start execution here.
+int main()
+{
+    if (get_current_thread_id() != 0)
+        worker_thread();
+
+    start_all_threads();
+
+    RenderContext *context = new RenderContext(0x1000000);
+    context->enableDepthBuffer(true);
+    context->enableProfiling(true);
+    context->setClearColor(0.0, 0.0, 0.0);
+
+    // The color buffer is in ordinary memory rather than a framebuffer, so
+    // nothing needs to be displayed.
+    RenderTarget *target = new RenderTarget();
+    Surface *colorBuffer = new Surface(FB_WIDTH, FB_HEIGHT);
+    Surface *depthBuffer = new Surface(FB_WIDTH, FB_HEIGHT, Surface::kTiled);
+    target->setColorBuffer(colorBuffer);
+    target->setDepthBuffer(depthBuffer);
+    Shader *shader = new TextureShader();
+
+    printf("render,scene,frames,cycles_per_frame,vertex_cycles,setup_cycles,sort_cycles,"
+           "pixel_cycles,fill_thread_cycles,flush_thread_cycles,geometry_l2_misses,"
+           "pixel_l2_misses,working_mem_bytes,triangles_per_frame,binned_per_frame,"
+           "triangles_per_sec\n");
+    for (int scene = 0; scene < kNumScenes; scene++)
+        runScene(kSceneFiles[scene], context, target, shader);
+
+    printf("render,done\n");
+    return 0;
+}
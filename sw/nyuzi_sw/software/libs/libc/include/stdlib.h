@@ -29,7 +29,7 @@ extern "C" {
 
 void *calloc(size_t size, size_t numElements);
 void *malloc(size_t size);
-void *memalign(size_t size, size_t align);
+void *memalign(size_t align, size_t size);
 void *realloc(void* oldmem, size_t bytes);
 void free(void*);
 
@@ -14,58 +14,360 @@
 // limitations under the License.
 //
 
+#include <assert.h>
 #include <stdio.h>
+#include "nyuzi.h"
 #include "registers.h"
 #include "schedule.h"
 
-static parallel_func_t current_func;
-static volatile int current_index;
-static volatile int max_index;
-static volatile int active_jobs;
-static void * volatile context;
+//
+// Work-stealing task scheduler. Each thread has a deque of tasks that are
+// ready to run. A thread pushes tasks it spawns onto the back of its own
+// deque and pops from the back, so it usually runs the task whose data is
+// most recently in its cache. Threads that run out of work steal from the
+// front of other threads' deques. Each deque has its own lock, so threads
+// only contend when one is stealing from another.
+//
+
+#define TASK_DEQUE_SIZE 256
+
+struct task_deque
+{
+    volatile int lock;
+    volatile unsigned int head;  // Thieves take tasks from here
+    volatile unsigned int tail;  // The owner pushes and pops here
+    struct task *tasks[TASK_DEQUE_SIZE];
+} __attribute__((aligned(64)));
+
+//
+// parallel_execute splits the indices into one share per thread. Shares
+// are padded to a cache line, so threads that are working on their own
+// share don't contend.
+//
+struct execute_share
+{
+    volatile int next;
+    int end;
+} __attribute__((aligned(64)));
+
+struct execute_job
+{
+    parallel_range_func_t range_func;
+    parallel_func_t func;   // Called for each index if range_func is null
+    void *context;
+    enum parallel_schedule schedule;
+    int chunk_size;
+    int num_shares;
+    volatile int next_share;
+
+    // Lowest share each thread may still take indices from.
+    int first_share[MAX_TASK_THREADS];
+
+    // Set while a thread is running run_execute_job for this job.
+    int active[MAX_TASK_THREADS];
+    struct execute_share shares[MAX_TASK_THREADS];
+};
+
+static struct task_deque deques[MAX_TASK_THREADS];
 
-static int dispatch_job(void)
+static struct task_deque *current_deque(void)
 {
-    int this_index;
+    // If there are more threads than deques, threads share them.
+    return &deques[get_current_thread_id() % MAX_TASK_THREADS];
+}
 
+static void lock_deque(struct task_deque *deque)
+{
     do
     {
-        this_index = current_index;
-        if (this_index == max_index)
-            return 0;	// No more jobs in this batch
+        // Spin on the L1 cached copy of the lock until it is released.
+        while (deque->lock)
+            ;
+    }
+    while (!__sync_bool_compare_and_swap(&deque->lock, 0, 1));
+}
+
+static void unlock_deque(struct task_deque *deque)
+{
+    __sync_synchronize();
+    deque->lock = 0;
+}
+
+static void run_task(struct task *task);
+
+static void push_task(struct task *task)
+{
+    struct task_deque *deque = current_deque();
+    lock_deque(deque);
+    if (deque->tail - deque->head == TASK_DEQUE_SIZE)
+    {
+        // The deque is full. Run the task now instead.
+        unlock_deque(deque);
+        run_task(task);
+        return;
     }
-    while (!__sync_bool_compare_and_swap(&current_index, this_index, this_index + 1));
 
-    current_func(context, this_index);
+    deque->tasks[deque->tail % TASK_DEQUE_SIZE] = task;
+    deque->tail++;
+    unlock_deque(deque);
+}
 
+static struct task *pop_task(struct task_deque *deque, int steal)
+{
+    struct task *task = 0;
+
+    // Check without the lock first, so idle threads only read their L1
+    // cached copy of empty deques.
+    if (deque->head == deque->tail)
+        return 0;
+
+    lock_deque(deque);
+    if (deque->head != deque->tail)
+    {
+        if (steal)
+            task = deque->tasks[deque->head++ % TASK_DEQUE_SIZE];
+        else
+            task = deque->tasks[--deque->tail % TASK_DEQUE_SIZE];
+    }
+
+    unlock_deque(deque);
+    return task;
+}
+
+static void task_ready(struct task *task)
+{
+    if (__sync_sub_and_fetch(&task->wait_count, 1) == 0)
+        push_task(task);
+}
+
+static void task_finished(struct task *task)
+{
+    struct task_group *group = task->group;
+    for (int i = 0; i < task->num_successors; i++)
+        task_ready(task->successors[i]);
+
+    if (group)
+    {
+        // The continuation holds a reference to the group, so when only
+        // that is left, all other tasks have finished. Once pending is
+        // decremented, a group without a continuation may already be
+        // finished, and the waiting thread may have reused its memory (it is
+        // often on the waiter's stack). Read the continuation first, and only
+        // touch the group afterward if it has one, which keeps it alive.
+        struct task *continuation = group->continuation;
+        int remaining = __sync_sub_and_fetch(&group->pending, 1);
+        if (remaining == 1 && continuation
+                && __sync_bool_compare_and_swap(&group->continuation, continuation, 0))
+            task_ready(continuation);
+    }
+}
+
+static void run_task(struct task *task)
+{
+    task->func(task->context, task->index);
+    task_finished(task);
+}
+
+// Run one task from this thread's deque or, if it is empty, steal one from
+// another thread. Returns 0 if there was no work.
+static int run_next_task(void)
+{
+    struct task_deque *own = current_deque();
+    struct task *task = pop_task(own, 0);
+    if (task == 0)
+    {
+        int start = own - deques;
+        for (int i = 1; i < MAX_TASK_THREADS && task == 0; i++)
+            task = pop_task(&deques[(start + i) % MAX_TASK_THREADS], 1);
+
+        if (task == 0)
+            return 0;
+    }
+
+    run_task(task);
     return 1;
 }
 
-void parallel_execute(parallel_func_t func, void *_context, int num_elements)
+void task_init(struct task *task, parallel_func_t func, void *context, int index)
+{
+    task->func = func;
+    task->context = context;
+    task->index = index;
+    task->group = 0;
+    task->wait_count = 1;
+    task->num_successors = 0;
+}
+
+void task_add_dependency(struct task *task, struct task *predecessor)
 {
-    current_func = func;
-    context = _context;
-    current_index = 0;
-    max_index = num_elements;
+    assert(predecessor->num_successors < TASK_MAX_SUCCESSORS);
+    predecessor->successors[predecessor->num_successors++] = task;
+    task->wait_count++;
+}
 
-    while (current_index != max_index)
-        dispatch_job();
+void task_group_init(struct task_group *group)
+{
+    group->pending = 0;
+    group->continuation = 0;
+}
 
-    while (active_jobs)
-        ; // Wait for threads to finish
+void task_group_set_continuation(struct task_group *group, struct task *continuation)
+{
+    continuation->group = group;
+    group->continuation = continuation;
+    __sync_fetch_and_add(&group->pending, 1);
 }
 
-void worker_thread(void)
+void task_spawn(struct task *task, struct task_group *group)
+{
+    task->group = group;
+    if (group)
+        __sync_fetch_and_add(&group->pending, 1);
+
+    task_ready(task);
+}
+
+void task_group_wait(struct task_group *group)
+{
+    while (group->pending)
+        run_next_task();
+}
+
+static void process_share(struct execute_job *job, struct execute_share *share)
 {
     while (1)
     {
-        while (current_index == max_index)
-            ;
+        int begin = share->next;
+        int remaining = share->end - begin;
+        int count;
+        if (remaining <= 0)
+            break;
+
+        if (job->schedule == SCHEDULE_STATIC)
+            count = remaining;
+        else if (job->schedule == SCHEDULE_GUIDED && remaining / 2 > job->chunk_size)
+            count = remaining / 2;
+        else
+            count = job->chunk_size < remaining ? job->chunk_size : remaining;
 
-        __sync_fetch_and_add(&active_jobs, 1);
-        dispatch_job();
-        __sync_fetch_and_add(&active_jobs, -1);
+        if (!__sync_bool_compare_and_swap(&share->next, begin, begin + count))
+            continue;   // Another thread took this range
+
+        if (job->range_func)
+            job->range_func(job->context, begin, begin + count);
+        else
+        {
+            for (int index = begin; index < begin + count; index++)
+                job->func(job->context, index);
+        }
+    }
+}
+
+//
+// Each thread processes indices in increasing order, as it did when there
+// was a single shared index. librender relies on this to keep per-thread
+// triangle bins sorted. Shares are claimed in order, and once all are
+// claimed, a thread only helps with shares after the last one it worked on.
+//
+// This needs a separate slot for each thread, so thread ids must be less
+// than MAX_TASK_THREADS. If the function being executed waits for other
+// tasks (for example by calling parallel_execute), the thread may pick up
+// another task for this same job while it is in the middle of a share.
+// Running it would take indices out of order, so it returns without doing
+// anything. The thread's outer call claims or helps with the remaining
+// shares when the function returns.
+//
+static void run_execute_job(void *_job, int unused)
+{
+    struct execute_job *job = (struct execute_job*) _job;
+    int thread = get_current_thread_id();
+    int share;
+
+    (void) unused;
+    assert(thread < MAX_TASK_THREADS);
+    if (job->active[thread])
+        return;
+
+    job->active[thread] = 1;
+    while ((share = __sync_fetch_and_add(&job->next_share, 1)) < job->num_shares)
+    {
+        job->first_share[thread] = share;
+        process_share(job, &job->shares[share]);
     }
+
+    for (share = job->first_share[thread]; share < job->num_shares; share++)
+        process_share(job, &job->shares[share]);
+
+    job->first_share[thread] = job->num_shares;
+    job->active[thread] = 0;
+}
+
+static void run_parallel_job(struct execute_job *job, int num_elements)
+{
+    struct task tasks[MAX_TASK_THREADS];
+    struct task_group group;
+
+    if (num_elements <= 0)
+        return;
+
+    if (job->chunk_size < 1)
+        job->chunk_size = 1;
+
+    job->num_shares = num_elements < MAX_TASK_THREADS ? num_elements : MAX_TASK_THREADS;
+    job->next_share = 0;
+    task_group_init(&group);
+    for (int i = 0; i < MAX_TASK_THREADS; i++)
+    {
+        job->first_share[i] = 0;
+        job->active[i] = 0;
+    }
+
+    for (int i = 0; i < job->num_shares; i++)
+    {
+        job->shares[i].next = num_elements * i / job->num_shares;
+        job->shares[i].end = num_elements * (i + 1) / job->num_shares;
+    }
+
+    // One task for each share. Idle threads steal them, and this thread
+    // runs whichever are left while it waits.
+    for (int i = 0; i < job->num_shares; i++)
+    {
+        task_init(&tasks[i], run_execute_job, job, i);
+        task_spawn(&tasks[i], &group);
+    }
+
+    task_group_wait(&group);
+}
+
+void parallel_execute(parallel_func_t func, void *context, int num_elements)
+{
+    struct execute_job job;
+
+    job.range_func = 0;
+    job.func = func;
+    job.context = context;
+    job.schedule = SCHEDULE_DYNAMIC;
+    job.chunk_size = 1;
+    run_parallel_job(&job, num_elements);
+}
+
+void parallel_execute_range(parallel_range_func_t func, void *context, int num_elements,
+                            enum parallel_schedule schedule, int chunk_size)
+{
+    struct execute_job job;
+
+    job.range_func = func;
+    job.func = 0;
+    job.context = context;
+    job.schedule = schedule;
+    job.chunk_size = chunk_size;
+    run_parallel_job(&job, num_elements);
+}
+
+void worker_thread(void)
+{
+    while (1)
+        run_next_task();
 }
 
 void start_all_threads(void)
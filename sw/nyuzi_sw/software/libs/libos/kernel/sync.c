@@ -0,0 +1,95 @@
+//
+// Copyright 2011-2015 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include <assert.h>
+#include "sync.h"
+
+void barrier_init(struct barrier *barrier, int num_threads)
+{
+    assert(num_threads > 0);
+    barrier->count = 0;
+    barrier->sense = 0;
+    barrier->num_threads = num_threads;
+}
+
+void barrier_wait(struct barrier *barrier)
+{
+    // Read the sense before arriving. The barrier can't be released until
+    // this thread has incremented the count, so this is the sense of the
+    // current episode.
+    int sense = barrier->sense;
+    if (__sync_add_and_fetch(&barrier->count, 1) == barrier->num_threads)
+    {
+        // Reset the count before releasing the other threads. A thread that
+        // leaves and arrives at the barrier again must see the count at zero.
+        barrier->count = 0;
+        __sync_synchronize();
+        barrier->sense = !sense;
+    }
+    else
+    {
+        while (barrier->sense == sense)
+            ;
+    }
+
+    __sync_synchronize();
+}
+
+void ticket_lock_init(struct ticket_lock *lock)
+{
+    lock->next_ticket = 0;
+    lock->now_serving = 0;
+}
+
+void ticket_lock_acquire(struct ticket_lock *lock)
+{
+    unsigned int ticket = __sync_fetch_and_add(&lock->next_ticket, 1);
+    while (lock->now_serving != ticket)
+        ;
+
+    __sync_synchronize();
+}
+
+void ticket_lock_release(struct ticket_lock *lock)
+{
+    // Only the thread that holds the lock writes now_serving, so this
+    // doesn't need an atomic operation.
+    __sync_synchronize();
+    lock->now_serving = lock->now_serving + 1;
+}
+
+void latch_init(struct latch *latch, int count)
+{
+    assert(count >= 0);
+    latch->count = count;
+}
+
+void latch_count_down(struct latch *latch)
+{
+    __sync_synchronize();
+    int count = __sync_sub_and_fetch(&latch->count, 1);
+    assert(count >= 0);
+    (void) count;
+}
+
+void latch_wait(struct latch *latch)
+{
+    while (latch->count > 0)
+        ;
+
+    __sync_synchronize();
+}
@@ -19,15 +19,108 @@
 
 typedef void (*parallel_func_t)(void *context, int index);
 
+// Processes the indices from begin up to, but not including, end.
+typedef void (*parallel_range_func_t)(void *context, int begin, int end);
+
+// How parallel_execute_range hands out indices.
+enum parallel_schedule
+{
+    // Each thread's share is passed as one range. This has the least
+    // overhead when all indices take about the same time.
+    SCHEDULE_STATIC,
+
+    // Ranges of chunk_size indices are handed out until the shares are
+    // used up, and threads that finish their share help with others.
+    SCHEDULE_DYNAMIC,
+
+    // Like SCHEDULE_DYNAMIC, but each range is half of what is left in
+    // the share, down to a minimum of chunk_size. Large ranges at the start
+    // keep overhead low, and small ones at the end balance the load.
+    SCHEDULE_GUIDED
+};
+
+// Most threads the scheduler has a task deque for.
+#define MAX_TASK_THREADS 16
+
+// Most tasks that can depend on a single task.
+#define TASK_MAX_SUCCESSORS 4
+
+//
+// A unit of work for the task scheduler, which calls func(context, index).
+// The caller owns the memory, which must remain valid until the task has
+// finished. Initialize it with task_init.
+//
+struct task
+{
+    parallel_func_t func;
+    void *context;
+    int index;
+    struct task_group *group;
+
+    // Number of unfinished predecessors, plus one until the task is
+    // spawned. The task is queued when this reaches zero.
+    volatile int wait_count;
+    struct task *successors[TASK_MAX_SUCCESSORS];
+    int num_successors;
+};
+
+//
+// Tracks completion of a set of tasks. A group may have a continuation
+// task, which is queued when all other tasks in the group have finished,
+// and counts as part of the group.
+//
+struct task_group
+{
+    volatile int pending;
+    struct task * volatile continuation;
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-// parallel_spawn should only be called from the main thread. It waits for
-// all jobs to complete before returning.
+// Runs func(context, index) for every index from 0 to num_elements - 1 in
+// parallel, and waits for all of them to complete before returning. Each
+// thread works through its own share of the indices, and takes indices
+// from other shares when it runs out. This can be called from any thread,
+// including from inside a task or another parallel_execute, because the
+// waiting thread runs other tasks.
+// This is the same as parallel_execute_range with SCHEDULE_DYNAMIC and a
+// chunk size of 1.
 void parallel_execute(parallel_func_t func, void *context, int num_elements);
 
-// main should call this function for all threads other than 0.
+// Calls func with ranges that cover the indices from 0 to num_elements - 1,
+// in parallel, and waits for all of them to complete. Passing a range lets
+// func amortize per-call overhead, or vectorize across indices.
+// Each thread receives increasing ranges. The calling threads' ids must be
+// less than MAX_TASK_THREADS.
+void parallel_execute_range(parallel_range_func_t func, void *context, int num_elements,
+                            enum parallel_schedule schedule, int chunk_size);
+
+void task_init(struct task *task, parallel_func_t func, void *context, int index);
+
+// task will not start until predecessor has finished. This must be called
+// before either task is spawned.
+void task_add_dependency(struct task *task, struct task *predecessor);
+
+void task_group_init(struct task_group *group);
+
+// continuation runs after all other tasks in the group have finished. This
+// must be called before any tasks are spawned into the group, and no tasks
+// may be added to the group after its other tasks have finished.
+void task_group_set_continuation(struct task_group *group, struct task *continuation);
+
+// Add the task to a group (which may be NULL) and queue it on the calling
+// thread's deque. If it has unfinished predecessors, it is queued when the
+// last one finishes. Idle threads steal tasks from other threads' deques.
+void task_spawn(struct task *task, struct task_group *group);
+
+// Wait for all tasks in the group, including its continuation, to finish.
+// The calling thread runs queued tasks while it waits.
+void task_group_wait(struct task_group *group);
+
+// main should call this function for all threads other than 0. It runs
+// tasks from the deques forever.
 void worker_thread(void) __attribute__ ((noreturn));
 
 void start_all_threads(void);
@@ -35,4 +128,3 @@ void start_all_threads(void);
 #ifdef __cplusplus
 }
 #endif
-
@@ -0,0 +1,95 @@
+//
+// Copyright 2011-2015 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#pragma once
+
+//
+// Synchronization primitives for hardware threads. Waiters busy wait on the
+// copy of the variable in their L1 cache, which doesn't create traffic on the
+// L2 interface. When another thread writes the variable, the coherence
+// broadcast updates the L1 copy and the waiter sees the new value. There is
+// no instruction that suspends a thread until a cache line changes, so
+// waiting threads still take issue slots from other threads on the same core.
+//
+
+#define SYNC_CACHE_LINE_SIZE 64
+
+//
+// Sense-reversing barrier. Each thread that calls barrier_wait blocks until
+// num_threads threads have called it. The last thread to arrive resets the
+// count and then flips the sense, which releases the others. A thread may
+// call barrier_wait again immediately, even if other threads haven't left
+// the previous one yet, because it waits for the sense to flip again rather
+// than for the count to reach zero.
+//
+struct barrier
+{
+    volatile int count;
+    volatile int sense;
+    int num_threads;
+};
+
+#define BARRIER_INIT(num_threads) { 0, 0, (num_threads) }
+
+//
+// Ticket lock. Threads acquire the lock in the order they requested it,
+// so no thread can be starved. now_serving is in a separate cache line
+// from next_ticket, so threads requesting the lock don't disturb the ones
+// waiting for it.
+//
+struct ticket_lock
+{
+    volatile unsigned int next_ticket;
+    char padding[SYNC_CACHE_LINE_SIZE - sizeof(unsigned int)];
+    volatile unsigned int now_serving;
+};
+
+#define TICKET_LOCK_INIT { 0, { 0 }, 0 }
+
+//
+// Countdown latch. Threads that call latch_wait block until latch_count_down
+// has been called count times. Once open, a latch stays open until it is
+// initialized again. A latch with a count of one is an event that one
+// thread signals.
+//
+struct latch
+{
+    volatile int count;
+};
+
+#define LATCH_INIT(count) { (count) }
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void barrier_init(struct barrier *barrier, int num_threads);
+void barrier_wait(struct barrier *barrier);
+
+void ticket_lock_init(struct ticket_lock *lock);
+void ticket_lock_acquire(struct ticket_lock *lock);
+void ticket_lock_release(struct ticket_lock *lock);
+
+void latch_init(struct latch *latch, int count);
+void latch_count_down(struct latch *latch);
+
+// Returns immediately if the count has already reached zero.
+void latch_wait(struct latch *latch);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,60 @@
+//
+// Copyright 2011-2015 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include <assert.h>
+#include <string.h>
+#include "CommandBuffer.h"
+
+namespace librender
+{
+
+CommandBuffer::CommandBuffer(unsigned int memSize)
+    : fAllocator(memSize)
+{
+    fDraws.setAllocator(&fAllocator);
+}
+
+CommandBuffer::~CommandBuffer()
+{
+    fDraws.reset();
+}
+
+void CommandBuffer::reset()
+{
+    fDraws.reset();
+    fAllocator.reset();
+    fNumDraws = 0;
+}
+
+void CommandBuffer::patchUniforms(size_t offset, const void *data, size_t size)
+{
+    // Consecutive draw calls often share a uniform block. Only copy it once.
+    const void *lastPatched = nullptr;
+    for (RecordedDraw &draw : fDraws)
+    {
+        RenderState &state = draw.state;
+        if (state.fUniforms == lastPatched)
+            continue;
+
+        assert(offset + size <= state.fUniformSize);
+        ::memcpy(const_cast<char*>(static_cast<const char*>(state.fUniforms)) + offset, data,
+                 size);
+        lastPatched = state.fUniforms;
+    }
+}
+
+} // namespace librender
@@ -0,0 +1,99 @@
+//
+// Copyright 2011-2015 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#pragma once
+
+#include "CommandQueue.h"
+#include "Matrix.h"
+#include "RegionAllocator.h"
+#include "RenderState.h"
+#include "Vec3.h"
+
+namespace librender
+{
+
+//
+// A retained sequence of draw calls. RenderContext::beginCommandBuffer
+// redirects draw calls into one of these instead of the current frame, and
+// RenderContext::executeCommandBuffer appends them to a frame without copying
+// their state again. Uniforms bound while recording are copied into the
+// buffer's own memory, so they stay valid across frames. Values that change
+// every frame, such as a view matrix, can be updated with patchUniforms.
+//
+// A frame that executed the buffer reads from it until it is finished, so
+// the buffer must not be patched, reset, or destroyed until then (after
+// finish(), or waitFrame() if submit() is used).
+//
+
+class CommandBuffer
+{
+public:
+    // memSize is the size of the memory region that holds draw states and
+    // uniforms.
+    explicit CommandBuffer(unsigned int memSize = 0x10000);
+    CommandBuffer(const CommandBuffer&) = delete;
+    CommandBuffer& operator=(const CommandBuffer&) = delete;
+    ~CommandBuffer();
+
+    // Discard all recorded draw calls.
+    void reset();
+
+    // Overwrite part of the uniforms of every recorded draw call. offset
+    // and size are in bytes and must be within the uniforms each draw call
+    // was recorded with.
+    void patchUniforms(size_t offset, const void *data, size_t size);
+
+    int getNumDraws() const
+    {
+        return fNumDraws;
+    }
+
+private:
+    friend class RenderContext;
+
+    struct RecordedDraw
+    {
+        RenderState state;
+        bool hasBounds;
+        Vec3 boundsMin;
+        Vec3 boundsMax;
+        Matrix boundsMatrix;
+
+        // If set, the draw call is skipped when executed if this query
+        // found it hidden (see RenderContext::drawElementsConditional).
+        const OcclusionQuery *condition;
+    };
+
+    typedef CommandQueue<RecordedDraw, 32> DrawList;
+
+    void *allocUniforms(size_t size)
+    {
+        return fAllocator.alloc(size);
+    }
+
+    void append(const RecordedDraw &draw)
+    {
+        fDraws.appendUnsynchronized(draw);
+        fNumDraws++;
+    }
+
+    RegionAllocator fAllocator;
+    DrawList fDraws;
+    int fNumDraws = 0;
+};
+
+} // namespace librender
@@ -73,6 +73,26 @@ public:
         bucket->items[index] = copyFrom;
     }
 
+    // Faster version of append for queues that only one thread writes to.
+    // This doesn't use any atomic operations, so it is not safe to call
+    // from multiple threads at the same time, but it preserves insertion
+    // order.
+    void appendUnsynchronized(const T &copyFrom)
+    {
+        if (fLastBucket == nullptr || fNextBucketIndex == BUCKET_SIZE)
+        {
+            appendBucket();
+            fNextBucketIndex = 0;
+        }
+
+        fLastBucket->items[fNextBucketIndex++] = copyFrom;
+    }
+
+    bool empty() const
+    {
+        return fFirstBucket == nullptr;
+    }
+
     // This function must be called before calling reset() on the
     // RegionAllocator this object is using to properly clean up objects and
     // to avoid stale pointers. This is not thread safe.
@@ -87,31 +107,14 @@ public:
         fNextBucketIndex = 0;
     }
 
-    // Sort all items in queue. This is not thread safe.
-    void sort()
-    {
-        if (!fFirstBucket)
-            return;		// Empty
-
-        // Insertion sort.  This is fairly efficient when the array
-        // is already mostly sorted, which is usually the case.
-        for (iterator i = begin().next(), e = end(); i != e; ++i)
-        {
-            iterator j = i;
-            while (j != begin() && *j.prev() > *j)
-            {
-                // swap
-                T temp = *j;
-                *j = *j.prev();
-                *j.prev() = temp;
-                --j;
-            }
-        }
-    }
-
     class iterator
     {
     public:
+        iterator()
+            :   fBucket(nullptr),
+                fIndex(0)
+        {}
+
         bool operator!=(const iterator &iter) const
         {
             return fBucket != iter.fBucket || fIndex != iter.fIndex;
@@ -215,20 +218,7 @@ private:
         // If they did, just return.
         if (fNextBucketIndex == BUCKET_SIZE || fLastBucket == nullptr)
         {
-            if (fLastBucket)
-            {
-                // Append to end of chain
-                Bucket *newBucket = new (*fAllocator) Bucket;
-                newBucket->prev = fLastBucket;
-                fLastBucket->next = newBucket;
-                fLastBucket = newBucket;
-            }
-            else
-            {
-                // Allocate initial bucket
-                fFirstBucket = new (*fAllocator) Bucket;
-                fLastBucket = fFirstBucket;
-            }
+            appendBucket();
 
             // We must update fNextBucketIndex after fLastBucket to avoid a race
             // condition with append.  Because they are volatile, the compiler won't
@@ -240,6 +230,26 @@ private:
         __sync_synchronize();
     }
 
+    // Add a new bucket to the end of the chain. The caller must ensure no
+    // other thread is modifying the queue.
+    void appendBucket()
+    {
+        if (fLastBucket)
+        {
+            // Append to end of chain
+            Bucket *newBucket = new (*fAllocator) Bucket;
+            newBucket->prev = fLastBucket;
+            fLastBucket->next = newBucket;
+            fLastBucket = newBucket;
+        }
+        else
+        {
+            // Allocate initial bucket
+            fFirstBucket = new (*fAllocator) Bucket;
+            fLastBucket = fFirstBucket;
+        }
+    }
+
     Bucket *fFirstBucket = nullptr;
     Bucket * volatile fLastBucket = nullptr;
     volatile int fNextBucketIndex = 0; // When the bucket is full, this equals BUCKET_SIZE
@@ -14,35 +14,19 @@
 // limitations under the License.
 //
 
+
+
 #pragma once
 
-//
-// Each thread that calls wait() will wait until all threads have called it.
-// At that point, they are all released.
-//
+#include <schedule.h>
 
-template <int NUM_THREADS>
-class Barrier
+namespace librender
 {
-public:
-    Barrier()
-        :	fWaitCount(0)
-    {
-    }
-
-    // This assumes all threads will be able to exit wait before another calls it
-    // If that wasn't the case, this would livelock.
-    void wait()
-    {
-        if (__sync_add_and_fetch(&fWaitCount, 1) == NUM_THREADS)
-            fWaitCount = 0;
-        else
-        {
-            while (fWaitCount)
-                ;	// Wait busily
-        }
-    }
-
-private:
-    volatile int fWaitCount;
-};
+
+const int kCacheLineSize = 64;
+
+// Most hardware threads that render. Each has its own slot in per-thread
+// state like tile bins and allocator chunks, indexed by thread id.
+const int kMaxThreads = MAX_TASK_THREADS;
+
+} // namespace librender
@@ -0,0 +1,49 @@
+//
+// Copyright 2011-2015 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include <stdio.h>
+#include "FrameStats.h"
+
+namespace librender
+{
+
+void FrameStats::print() const
+{
+    printf("cycles: vertex %u setup %u sort %u pixel %u\n", vertexCycles, setUpCycles,
+           sortCycles, pixelCycles);
+    printf("thread cycles: fill %u flush %u\n", fillCycles, flushCycles);
+    printf("misses: geometry L2 %u dcache %u, pixel L2 %u dcache %u\n", geometryL2Misses,
+           geometryDCacheMisses, pixelL2Misses, pixelDCacheMisses);
+    printf("draws: %d, %d frustum culled, %d occluded\n", numDraws, numFrustumCulledDraws,
+           numOccludedDraws);
+    printf("triangles: %d, %d frustum culled, %d backface culled, %d binned, %d occluded in tiles\n",
+           numTriangles, numFrustumCulledTriangles, numBackfaceCulledTriangles,
+           numBinnedTriangles, numOccludedTriangles);
+    if (tileTriangleCounts)
+    {
+        printf("triangles per tile:\n");
+        for (int y = 0; y < tileRows; y++)
+        {
+            for (int x = 0; x < tileColumns; x++)
+                printf("%5d", tileTriangleCounts[y * tileColumns + x]);
+
+            printf("\n");
+        }
+    }
+}
+
+} // namespace librender
@@ -0,0 +1,81 @@
+//
+// Copyright 2011-2015 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#pragma once
+
+namespace librender
+{
+
+//
+// Where the time in a frame went. RenderContext fills this in when a frame's
+// pixel phase finishes. Fill and flush cycles and cache misses are only
+// collected while profiling is enabled with RenderContext::enableProfiling,
+// because they read the cycle counter for every tile and use performance
+// counters the application may want for itself. The others are always
+// collected.
+//
+// Phase cycles are elapsed cycles on the thread that called finish() or
+// submit(), and include waiting for the slowest thread. With submit(), a
+// frame's tiles are filled during the geometry phase of the next frame, so
+// pixelCycles only covers the tiles left when waitFrame() was called, and
+// the geometry counts of the next frame include that fill work.
+//
+struct FrameStats
+{
+    // Elapsed cycles
+    unsigned int vertexCycles = 0;
+    unsigned int setUpCycles = 0;
+    unsigned int sortCycles = 0;
+    unsigned int pixelCycles = 0;
+
+    // Cycles summed over all threads, for filling tiles and writing them
+    // back to memory.
+    unsigned int fillCycles = 0;
+    unsigned int flushCycles = 0;
+
+    // Cache misses from the hardware performance counters, while the
+    // geometry and pixel phases were running.
+    unsigned int geometryL2Misses = 0;
+    unsigned int geometryDCacheMisses = 0;
+    unsigned int pixelL2Misses = 0;
+    unsigned int pixelDCacheMisses = 0;
+
+    int numDraws = 0;
+    int numFrustumCulledDraws = 0;	// Bounding box was outside the view frustum
+    int numOccludedDraws = 0;	// Skipped by drawElementsConditional
+
+    int numTriangles = 0;
+    int numFrustumCulledTriangles = 0;
+    int numBackfaceCulledTriangles = 0;	// Includes edge-on triangles
+    int numBinnedTriangles = 0;	// After clipping, which can split triangles
+
+    // Triangles that were skipped in a tile because they were behind
+    // everything already drawn there. A triangle counts once for each tile.
+    int numOccludedTriangles = 0;
+
+    // Number of triangles binned in each tile, in raster order. This points to
+    // memory owned by the RenderContext, which is valid until the next frame
+    // finishes.
+    const int *tileTriangleCounts = nullptr;
+    int tileColumns = 0;
+    int tileRows = 0;
+
+    // Write the stats to standard output, which goes to the serial port.
+    void print() const;
+};
+
+} // namespace librender
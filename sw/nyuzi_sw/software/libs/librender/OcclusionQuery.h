@@ -0,0 +1,91 @@
+//
+// Copyright 2011-2015 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#pragma once
+
+#include "Surface.h"
+
+namespace librender
+{
+
+//
+// Counts the pixels of draw calls that pass the depth test. Draw calls
+// issued between RenderContext::beginQuery and endQuery add to the count.
+// The count is available after the pixel phase of the frame has finished,
+// and stays available until the query is used in another frame finishes.
+// RenderContext::drawElementsConditional uses the result to skip draw calls
+// for objects that were hidden in a previous frame.
+//
+// A query should only be used for one range of draw calls per frame.
+//
+class OcclusionQuery
+{
+public:
+    OcclusionQuery() = default;
+    OcclusionQuery(const OcclusionQuery&) = delete;
+    OcclusionQuery& operator=(const OcclusionQuery&) = delete;
+
+    // Returns true if a frame that used this query has finished.
+    bool isResultAvailable() const
+    {
+        return fResultAvailable;
+    }
+
+    // Number of pixels that passed the depth test in the last finished
+    // frame that used this query.
+    int getSamplesPassed() const
+    {
+        return fSamplesPassed;
+    }
+
+private:
+    friend class RenderContext;
+
+    // Each thread counts into its own slot while filling tiles, so this
+    // doesn't need atomic operations. Slots are padded to the size of a
+    // cache line to limit false sharing.
+    void addSamples(int threadId, int count)
+    {
+        fThreadSamples[threadId].count += count;
+    }
+
+    // Called after the pixel phase finishes.
+    void resolve()
+    {
+        fSamplesPassed = 0;
+        for (int i = 0; i < kMaxThreads; i++)
+        {
+            fSamplesPassed += fThreadSamples[i].count;
+            fThreadSamples[i].count = 0;
+        }
+
+        fResultAvailable = true;
+    }
+
+    struct ThreadSamples
+    {
+        int count = 0;
+        char padding[kCacheLineSize - sizeof(int)];
+    } fThreadSamples[kMaxThreads];
+    int fSamplesPassed = 0;
+    bool fResultAvailable = false;
+
+    // Used by RenderContext to add each query to a frame only once.
+    int fLastFrame = -1;
+};
+
+} // namespace librender
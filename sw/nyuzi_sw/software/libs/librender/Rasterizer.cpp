@@ -138,10 +138,16 @@ void subdivideTile(
 
     const int subTileSizeBits = tileSizeBits - 2;
 
+    // At the top level, each sub-block corresponds to one of the coarse
+    // depth blocks in the filler. Skip the ones the triangle is completely
+    // behind.
+    const bool isTileLevel = tileSizeBits == __builtin_ctz(kTileSize);
+    const vmask_t occludedMask = isTileLevel ? filler.occludedBlocks() : 0;
+
     // Process all trivially accepted blocks
-    if (trivialAcceptMask != 0)
+    if ((trivialAcceptMask & ~occludedMask) != 0)
     {
-        unsigned int currentMask = trivialAcceptMask;
+        unsigned int currentMask = trivialAcceptMask & ~occludedMask;
 
         while (currentMask)
         {
@@ -157,6 +163,9 @@ void subdivideTile(
                 for (int x = 0; x < hcount; x += 4)
                     filler.fillMasked(subTileLeft + x, subTileTop + y, 0xffff);
             }
+
+            if (isTileLevel)
+                filler.coverBlock(index);
         }
     }
 
@@ -171,7 +180,7 @@ void subdivideTile(
 
     // Recurse into blocks that are neither trivially rejected or accepted.
     // They are partially overlapped and need to be further subdivided.
-    unsigned int recurseMask = (trivialAcceptMask | trivialRejectMask) ^ 0xffff;
+    unsigned int recurseMask = (trivialAcceptMask | trivialRejectMask | occludedMask) ^ 0xffff;
     if (recurseMask)
     {
         // Divide each step matrix by 4
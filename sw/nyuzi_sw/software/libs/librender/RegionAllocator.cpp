@@ -0,0 +1,120 @@
+//
+// Copyright 2011-2015 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include <string.h>
+#include "RegionAllocator.h"
+
+namespace librender
+{
+
+RegionAllocator::RegionAllocator(unsigned int arenaSize)
+    :	fArenaBase(new char[arenaSize]),
+        fTotalSize(arenaSize),
+        fNextAlloc(fArenaBase),
+        fBlockEnd(fArenaBase + arenaSize)
+{
+    ::memset(fThreadChunks, 0, sizeof(fThreadChunks));
+    ticket_lock_init(&fLock);
+}
+
+RegionAllocator::~RegionAllocator()
+{
+    freeOverflowBlocks();
+    delete [] fArenaBase;
+}
+
+void RegionAllocator::reset()
+{
+    if (fBytesUsed > fHighWaterMark)
+        fHighWaterMark = fBytesUsed;
+
+    if (fOverflowBlocks)
+    {
+        // Replace the arena with one that holds everything this frame
+        // allocated, with some room to spare, so the next frame is likely to
+        // fit without chaining blocks again.
+        freeOverflowBlocks();
+        delete [] fArenaBase;
+        fTotalSize = static_cast<unsigned int>(fHighWaterMark + fHighWaterMark / 4);
+        fArenaBase = new char[fTotalSize];
+    }
+
+    for (int i = 0; i < kMaxThreads; i++)
+    {
+        fThreadChunks[i].next = nullptr;
+        fThreadChunks[i].end = nullptr;
+    }
+
+    fNextAlloc = fArenaBase;
+    fBlockEnd = fArenaBase + fTotalSize;
+    fBytesUsed = 0;
+}
+
+void *RegionAllocator::allocSlow(size_t size, size_t alignment)
+{
+    // Large objects come straight from the shared block, so they don't
+    // waste most of a chunk.
+    if (size + alignment > kChunkSize / 4)
+        return allocShared(size, alignment);
+
+    // Start a new chunk. The rest of the old one is abandoned.
+    ThreadChunk &chunk = fThreadChunks[get_current_thread_id()];
+    chunk.next = static_cast<char*>(allocShared(kChunkSize, kCacheLineSize));
+    chunk.end = chunk.next + kChunkSize;
+
+    char *alignedAlloc = alignPointer(chunk.next, alignment);
+    chunk.next = alignedAlloc + size;
+    return alignedAlloc;
+}
+
+void *RegionAllocator::allocShared(size_t size, size_t alignment)
+{
+    ticket_lock_acquire(&fLock);
+    char *alignedAlloc = alignPointer(fNextAlloc, alignment);
+    if (alignedAlloc + size > fBlockEnd)
+    {
+        // Out of space. Chain another block from the heap, at least as large
+        // as the original arena, rather than failing the frame.
+        size_t blockSize = size + alignment > fTotalSize ? size + alignment : fTotalSize;
+        char *memory = new char[sizeof(OverflowBlock) + blockSize];
+        OverflowBlock *block = reinterpret_cast<OverflowBlock*>(memory);
+        block->next = fOverflowBlocks;
+        fOverflowBlocks = block;
+        fOverflowCount++;
+        fNextAlloc = memory + sizeof(OverflowBlock);
+        fBlockEnd = fNextAlloc + blockSize;
+        alignedAlloc = alignPointer(fNextAlloc, alignment);
+    }
+
+    fBytesUsed += static_cast<size_t>(alignedAlloc + size - fNextAlloc);
+    fNextAlloc = alignedAlloc + size;
+    ticket_lock_release(&fLock);
+
+    return alignedAlloc;
+}
+
+void RegionAllocator::freeOverflowBlocks()
+{
+    while (fOverflowBlocks)
+    {
+        OverflowBlock *block = fOverflowBlocks;
+        fOverflowBlocks = block->next;
+        delete [] reinterpret_cast<char*>(block);
+    }
+}
+
+} // namespace librender
@@ -18,7 +18,10 @@
 #pragma once
 
 #include <assert.h>
+#include <nyuzi.h>
 #include <stddef.h>
+#include <sync.h>
+#include "Constants.h"
 
 namespace librender
 {
@@ -27,63 +30,106 @@ namespace librender
 // This quickly allocates short-lived objects by slicing them off the end
 // of a larger chunk. It can only free all objects at once.
 // The advantages of this approach are:
-// - It's fast. The allocation policy is simple, and is easy to make lock-free
-//   to minimize synchronization overhead.
+// - It's fast. The allocation policy is simple, and each thread allocates
+//   from its own chunk of the arena without any synchronization.
 // - It doesn't have any internal fragmentation.
 //
+// If the arena runs out of space, the allocator chains additional blocks
+// from the heap. The next reset() replaces the arena with one large enough
+// for everything that was allocated, so later frames don't overflow.
+//
 
 class RegionAllocator
 {
 public:
-    explicit RegionAllocator(unsigned int arenaSize)
-        :	fArenaBase(new char[arenaSize]),
-            fTotalSize(arenaSize),
-            fNextAlloc(fArenaBase)
-    {
-    }
-
+    explicit RegionAllocator(unsigned int arenaSize);
     RegionAllocator(const RegionAllocator&) = delete;
     RegionAllocator& operator=(const RegionAllocator&) = delete;
+    ~RegionAllocator();
 
-    ~RegionAllocator()
-    {
-        delete [] fArenaBase;
-    }
-
-    // This is reentrant and lock-free. Alignment must be a power of 2
+    // This is reentrant. Alignment must be a power of 2
     void *alloc(size_t size, size_t alignment = 4)
     {
-        char *nextAlloc;
-        char *alignedAlloc;
-
-        do
+        int threadId = get_current_thread_id();
+        assert(threadId < kMaxThreads);
+        ThreadChunk &chunk = fThreadChunks[threadId];
+        char *alignedAlloc = alignPointer(chunk.next, alignment);
+        if (alignedAlloc + size < chunk.end)
         {
-            nextAlloc = fNextAlloc;
-            alignedAlloc = reinterpret_cast<char*>((reinterpret_cast<unsigned int>(nextAlloc)
-                                                    + alignment - 1) & ~(alignment - 1));
-            assert(alignedAlloc + size < fArenaBase + fTotalSize);
+            chunk.next = alignedAlloc + size;
+            return alignedAlloc;
         }
-        while (!__sync_bool_compare_and_swap(&fNextAlloc, nextAlloc, alignedAlloc + size));
 
-        return alignedAlloc;
+        return allocSlow(size, alignment);
     }
 
     // This is not thread safe.  Caller must guarantee no other threads
     // are calling other methods on the allocator when this is called
-    void reset()
+    void reset();
+
+    // Bytes taken from the arena since the last reset. This includes the
+    // unused ends of per-thread chunks.
+    size_t bytesUsed() const
     {
-        fNextAlloc = fArenaBase;
+        return fBytesUsed;
     }
 
-    size_t bytesUsed() const
+    // Most bytes used between any two resets, including the current one.
+    // An arena of this size would not have overflowed.
+    size_t highWaterMark() const
     {
-        return static_cast<size_t>(fNextAlloc - fArenaBase);
+        return fBytesUsed > fHighWaterMark ? fBytesUsed : fHighWaterMark;
+    }
+
+    // Number of times the arena ran out of space since the allocator was
+    // created.
+    int overflowCount() const
+    {
+        return fOverflowCount;
     }
 
 private:
+    // Objects up to a quarter of this size are allocated from per-thread
+    // chunks. This is large enough for triangle blocks and tile bin buckets,
+    // the most frequent allocations, to take that path.
+    static const size_t kChunkSize = 16384;
+
+    struct ThreadChunk
+    {
+        char *next;
+        char *end;
+
+        // Keep chunks for different threads out of each other's cache lines.
+        char padding[kCacheLineSize - sizeof(char*) * 2];
+    };
+
+    struct OverflowBlock
+    {
+        OverflowBlock *next;
+    };
+
+    static char *alignPointer(char *ptr, size_t alignment)
+    {
+        return reinterpret_cast<char*>((reinterpret_cast<unsigned int>(ptr)
+                                        + alignment - 1) & ~(alignment - 1));
+    }
+
+    void *allocSlow(size_t size, size_t alignment);
+    void *allocShared(size_t size, size_t alignment);
+    void freeOverflowBlocks();
+
+    ThreadChunk fThreadChunks[kMaxThreads];
     char *fArenaBase;
     unsigned int fTotalSize;
-    char * volatile fNextAlloc;
+
+    // The following are protected by fLock.
+    ticket_lock fLock;
+    char *fNextAlloc;
+    char *fBlockEnd;
+    OverflowBlock *fOverflowBlocks = nullptr;
+    size_t fBytesUsed = 0;
+    size_t fHighWaterMark = 0;
+    int fOverflowCount = 0;
 };
 
 } // namespace librender
@@ -14,6 +14,8 @@
 // limitations under the License.
 //
 
+#include <nyuzi.h>
+#include <performance_counters.h>
 #include <schedule.h>
 #include <string.h>
 #include "line.h"
@@ -25,11 +27,92 @@
 namespace librender
 {
 
+namespace
+{
+
+// Smallest range of triangles that setup hands to a thread.
+const int kSetUpChunkSize = 16;
+
+// Performance counters used when profiling is enabled.
+const int kL2MissCounter = 0;
+const int kDCacheMissCounter = 1;
+
+// Log2 of a tile's triangle count, used to order tiles by cost.
+int getCostBucket(int triangleCount)
+{
+    return triangleCount == 0 ? 0 : 32 - __builtin_clz(static_cast<unsigned int>(triangleCount));
+}
+
+//
+// Walks a set of sorted queues in increasing sequence number order.
+//
+template <typename T, int BUCKET_SIZE, int MAX_QUEUES>
+class QueueMerger
+{
+public:
+    explicit QueueMerger(CommandQueue<T, BUCKET_SIZE> *queues)
+    {
+        for (int i = 0; i < MAX_QUEUES; i++)
+        {
+            if (!queues[i].empty())
+            {
+                fHeads[fNumQueues] = queues[i].begin();
+                fEnds[fNumQueues] = queues[i].end();
+                fNumQueues++;
+            }
+        }
+    }
+
+    // Returns nullptr when all queues are exhausted.
+    const T *next()
+    {
+        if (fNumQueues == 0)
+            return nullptr;
+
+        int lowest = 0;
+        for (int i = 1; i < fNumQueues; i++)
+        {
+            if ((*fHeads[i]).sequenceNumber < (*fHeads[lowest]).sequenceNumber)
+                lowest = i;
+        }
+
+        const T *item = &*fHeads[lowest];
+        if (++fHeads[lowest] == fEnds[lowest])
+        {
+            // Remove this queue by moving the last one into its slot.
+            fNumQueues--;
+            fHeads[lowest] = fHeads[fNumQueues];
+            fEnds[lowest] = fEnds[fNumQueues];
+        }
+
+        return item;
+    }
+
+private:
+    typename CommandQueue<T, BUCKET_SIZE>::iterator fHeads[MAX_QUEUES];
+    typename CommandQueue<T, BUCKET_SIZE>::iterator fEnds[MAX_QUEUES];
+    int fNumQueues = 0;
+};
+
+} // namespace
+
 RenderContext::RenderContext(size_t workingMemSize)
     : 	fClearColorBuffer(false),
-       fAllocator(workingMemSize)
+       fWorkingMemSize(workingMemSize),
+       fDefaultAllocator(workingMemSize),
+       fAllocator(&fDefaultAllocator)
 {
-    fDrawQueue.setAllocator(&fAllocator);
+    fDrawQueue.setAllocator(fAllocator);
+    memset(fThreadStats, 0, sizeof(fThreadStats));
+}
+
+RenderContext::~RenderContext()
+{
+    waitFrame();
+    fDrawQueue.reset();
+    delete fAlternateAllocator;
+    delete [] fStatsTileCounts;
+    delete [] fVertexSlots;
 }
 
 void RenderContext::setClearColor(float r, float g, float b)
@@ -49,16 +132,22 @@ void RenderContext::bindVertexAttrs(const RenderBuffer *vertexAttrs)
 
 void RenderContext::bindUniforms(const void *uniforms, size_t size)
 {
-    void *uniformCopy = fAllocator.alloc(size);
+    void *uniformCopy;
+    if (fRecordingBuffer)
+        uniformCopy = fRecordingBuffer->allocUniforms(size);
+    else
+        uniformCopy = fAllocator->alloc(size);
+
     ::memcpy(uniformCopy, uniforms, size);
     fCurrentState.fUniforms = uniformCopy;
+    fCurrentState.fUniformSize = size;
 }
 
 void RenderContext::bindTarget(RenderTarget *target)
 {
     fRenderTarget = target;
-    fFbWidth = fRenderTarget->getColorBuffer()->getWidth();
-    fFbHeight = fRenderTarget->getColorBuffer()->getHeight();
+    fFbWidth = fRenderTarget->getPrimarySurface()->getWidth();
+    fFbHeight = fRenderTarget->getPrimarySurface()->getHeight();
     fTileColumns = (fFbWidth + kTileSize - 1) / kTileSize;
     fTileRows = (fFbHeight + kTileSize - 1) / kTileSize;
 }
@@ -71,85 +160,474 @@ void RenderContext::bindShader(Shader *shader)
 
 void RenderContext::drawElements(const RenderBuffer *indices)
 {
+    drawElementsInstanced(indices, 1, nullptr);
+}
+
+void RenderContext::drawElementsInstanced(const RenderBuffer *indices, int instanceCount,
+        const RenderBuffer *instanceAttrs)
+{
+    assert(instanceAttrs != nullptr || fCurrentState.fShader->getNumInstanceAttribs() == 0);
+    assert(instanceAttrs == nullptr || instanceAttrs->getNumElements() >= instanceCount);
     fCurrentState.fIndexBuffer = indices;
-    fDrawQueue.append(fCurrentState);
+    fCurrentState.fNumInstances = instanceCount;
+    fCurrentState.fInstanceAttrBuffer = instanceAttrs;
+
+    // Pick the fill pipeline for this draw once, rather than checking the
+    // state for every block of pixels.
+    for (int perspective = 0; perspective < 2; perspective++)
+    {
+        FillFunction func = fCurrentState.fShader->getFillFunction(fCurrentState,
+                            perspective != 0);
+        if (func == nullptr)
+            func = TriangleFiller::getGenericFillFunction(fCurrentState, perspective != 0);
+
+        fCurrentState.fFillFunctions[perspective] = func;
+    }
+
+    if (fRecordingBuffer)
+    {
+        CommandBuffer::RecordedDraw draw;
+        draw.state = fCurrentState;
+        draw.hasBounds = false;
+        draw.condition = nullptr;
+        fRecordingBuffer->append(draw);
+        return;
+    }
+
+    appendDraw(new (*fAllocator) RenderState(fCurrentState));
 }
 
-void RenderContext::_shadeVertices(void *_castToContext, int index)
+void RenderContext::appendDraw(const RenderState *state)
 {
-    static_cast<RenderContext*>(_castToContext)->shadeVertices(index);
+    // The query is resolved when this frame's pixel phase finishes.
+    OcclusionQuery *query = state->fOcclusionQuery;
+    if (query && query->fLastFrame != fFrameNumber)
+    {
+        query->fLastFrame = fFrameNumber;
+        QueryLink *link = new (*fAllocator) QueryLink;
+        link->query = query;
+        link->next = fFrameQueries;
+        fFrameQueries = link;
+    }
+
+    DrawCommand command;
+    command.state = state;
+    command.vertexParams = nullptr;
+    fDrawQueue.appendUnsynchronized(command);
+}
+
+void RenderContext::_pipelinedJob(void *_castToContext, int index)
+{
+    RenderContext *context = static_cast<RenderContext*>(_castToContext);
+    if (index < context->fNumGeometryJobs)
+    {
+        int begin = index * context->fGeometryChunkSize;
+        context->fGeometryFunc(_castToContext, begin, min(begin + context->fGeometryChunkSize,
+                               context->fNumGeometryItems));
+    }
+    else
+        context->pixelJob(context->fPixelFrame.nextTile + index - context->fNumGeometryJobs);
 }
 
-void RenderContext::_setUpTriangle(void *_castToContext, int index)
+void RenderContext::_shadeVertices(void *_castToContext, int begin, int end)
 {
-    static_cast<RenderContext*>(_castToContext)->setUpTriangle(index);
+    RenderContext *context = static_cast<RenderContext*>(_castToContext);
+    for (int index = begin; index < end; index++)
+        context->shadeVertices(index);
 }
 
-void RenderContext::_fillTile(void *_castToContext, int index)
+void RenderContext::_shadeIndexedVertices(void *_castToContext, int begin, int end)
 {
-    static_cast<RenderContext*>(_castToContext)->fillTile(index);
+    RenderContext *context = static_cast<RenderContext*>(_castToContext);
+    for (int index = begin; index < end; index++)
+        context->shadeIndexedVertices(index);
 }
 
-void RenderContext::_wireframeTile(void *_castToContext, int index)
+void RenderContext::_setUpTriangles(void *_castToContext, int begin, int end)
 {
-    static_cast<RenderContext*>(_castToContext)->wireframeTile(index);
+    RenderContext *context = static_cast<RenderContext*>(_castToContext);
+    for (int index = begin; index < end; index++)
+        context->setUpTriangle(index);
 }
 
 void RenderContext::finish()
+{
+    // Render the whole frame with the current allocator. This doesn't
+    // need the alternate allocator unless submit() is also used.
+    waitFrame();
+    runGeometryPhase();
+    beginPixelPhase();
+    waitFrame();
+}
+
+void RenderContext::submit()
+{
+    // If a frame is already pending, the pixel phase for it is spread
+    // across the geometry phase of this one.
+    runGeometryPhase();
+    waitFrame();
+    beginPixelPhase();
+
+    // Record the next frame into the other allocator while this one
+    // renders.
+    if (fAlternateAllocator == nullptr)
+        fAlternateAllocator = new RegionAllocator(fWorkingMemSize);
+
+    fAllocator = fAllocator == &fDefaultAllocator ? fAlternateAllocator : &fDefaultAllocator;
+    fDrawQueue.setAllocator(fAllocator);
+}
+
+void RenderContext::waitFrame()
+{
+    if (!fPixelFramePending)
+        return;
+
+    // Pixel phase.  Shade the pixels and write back.
+    unsigned int pixelStartTime = get_cycle_count();
+    int remainingTiles = fPixelFrame.numTiles - fPixelFrame.nextTile;
+    if (remainingTiles > 0)
+    {
+        fGeometryFunc = nullptr;
+        fNumGeometryJobs = 0;
+        parallel_execute(_pipelinedJob, this, remainingTiles);
+        fPixelFrame.nextTile = fPixelFrame.numTiles;
+    }
+
+    fPixelFrame.stats.pixelCycles = get_cycle_count() - pixelStartTime;
+
+#if DISPLAY_STATS
+    printf("used %zu bytes (high water %zu, %d overflows)\n",
+           fPixelFrame.allocator->bytesUsed(), fPixelFrame.allocator->highWaterMark(),
+           fPixelFrame.allocator->overflowCount());
+#endif
+
+    // Sum the per-thread counts of the frame's occlusion queries.
+    for (QueryLink *link = fPixelFrame.queries; link; link = link->next)
+        link->query->resolve();
+
+    resolveFrameStats();
+
+    // The draw queue was already reset when the pixel phase started, so the
+    // allocator can free everything.
+    fPixelFrame.allocator->reset();
+    fPixelFramePending = false;
+}
+
+void RenderContext::enableProfiling(bool enable)
+{
+    fProfiling = enable;
+    if (enable)
+    {
+        set_perf_counter_event(kL2MissCounter, PERF_L2_MISS);
+        set_perf_counter_event(kDCacheMissCounter, PERF_DCACHE_MISS);
+    }
+}
+
+size_t RenderContext::getWorkingMemHighWaterMark() const
+{
+    size_t highWaterMark = fDefaultAllocator.highWaterMark();
+    if (fAlternateAllocator && fAlternateAllocator->highWaterMark() > highWaterMark)
+        highWaterMark = fAlternateAllocator->highWaterMark();
+
+    return highWaterMark;
+}
+
+//
+// Geometry phase.  Walk through each draw command and perform two steps
+// for each one:
+// 1. Call vertex shader on attributes (shadeVertices)
+// 2. Perform triangle setup and binning (setUpTriangle)
+//
+void RenderContext::runGeometryPhase()
 {
     int kMaxTiles = fTileColumns * fTileRows;
-    fTiles = new (fAllocator) TriangleArray[kMaxTiles];
-    for (int i = 0; i < kMaxTiles; i++)
-        fTiles[i].setAllocator(&fAllocator);
-
-    // Geometry phase.  Walk through each draw command and perform two steps
-    // for each one:
-    // 1. Call vertex shader on attributes (shadeVertices)
-    // 2. Perform triangle setup and binning (setUpTriangle)
+    fTiles = new (*fAllocator) TriangleArray[kMaxTiles * kMaxThreads];
+    for (int i = 0; i < kMaxTiles * kMaxThreads; i++)
+        fTiles[i].setAllocator(fAllocator);
+
+    size_t countsSize = sizeof(int) * static_cast<unsigned int>(kMaxTiles * kMaxThreads);
+    fTileTriangleCounts = static_cast<int*>(fAllocator->alloc(countsSize));
+    memset(fTileTriangleCounts, 0, countsSize);
+
+    for (int i = 0; i < kMaxThreads; i++)
+    {
+        fCurrentTriangleBlock[i] = nullptr;
+        fNextTriangleSlot[i] = 16;
+        fThreadStats[i].frustumCulledTriangles = 0;
+        fThreadStats[i].backfaceCulledTriangles = 0;
+        fThreadStats[i].binnedTriangles = 0;
+    }
+
+    unsigned int startL2Misses = 0;
+    unsigned int startDCacheMisses = 0;
+    if (fProfiling)
+    {
+        startL2Misses = read_perf_counter(kL2MissCounter);
+        startDCacheMisses = read_perf_counter(kDCacheMissCounter);
+    }
+
+    int numDraws = 0;
+    for (DrawQueue::iterator it = fDrawQueue.begin(); it != fDrawQueue.end(); ++it)
+        numDraws++;
+
+    int stepsRemaining = numDraws * 2;
     fBaseSequenceNumber = 0;
     for (fRenderCommandIterator = fDrawQueue.begin(); fRenderCommandIterator != fDrawQueue.end();
             ++fRenderCommandIterator)
     {
-        RenderState &state = *fRenderCommandIterator;
-        int numVertices = state.fVertexAttrBuffer->getNumElements();
-        int numTriangles = state.fIndexBuffer->getNumElements() / 3;
-        state.fVertexParams = static_cast<float*>(fAllocator.alloc(
-                                  static_cast<unsigned int>(numVertices)
-                                  * static_cast<unsigned int>(state.fShader->getNumParams())
-                                  * sizeof(int)));
-        parallel_execute(_shadeVertices, this, (numVertices + 15) / 16);
-        parallel_execute(_setUpTriangle, this, numTriangles);
+        DrawCommand &command = *fRenderCommandIterator;
+        const RenderState &state = *command.state;
+
+        // The vertices of all instances are shaded as one array, with
+        // instance n starting at n times the number of vertices.
+        int numVertices = state.fVertexAttrBuffer->getNumElements() * state.fNumInstances;
+        int numIndices = state.fIndexBuffer->getNumElements() * state.fNumInstances;
+        int numTriangles = state.fIndexBuffer->getNumElements() / 3 * state.fNumInstances;
+        unsigned int vertexStartTime = get_cycle_count();
+        if (state.fIndexedVertexShading)
+        {
+            // A draw can't reference more unique vertices than it has
+            // indices.
+            int maxShadedVertices = min(numVertices, numIndices);
+            command.vertexParams = static_cast<float*>(fAllocator->alloc(
+                                       static_cast<unsigned int>(maxShadedVertices)
+                                       * static_cast<unsigned int>(state.fShader->getNumParams())
+                                       * sizeof(int)));
+            beginVertexSlotGeneration(numVertices);
+            fNumShadedVertices = 0;
+            runGeometryStep(_shadeIndexedVertices, (numIndices + 15) / 16, SCHEDULE_DYNAMIC, 1,
+                            stepsRemaining--);
+        }
+        else
+        {
+            command.vertexParams = static_cast<float*>(fAllocator->alloc(
+                                       static_cast<unsigned int>(numVertices)
+                                       * static_cast<unsigned int>(state.fShader->getNumParams())
+                                       * sizeof(int)));
+            runGeometryStep(_shadeVertices, (numVertices + 15) / 16, SCHEDULE_DYNAMIC, 1,
+                            stepsRemaining--);
+        }
+
+        unsigned int setUpStartTime = get_cycle_count();
+        fRecordingStats.vertexCycles += setUpStartTime - vertexStartTime;
+        runGeometryStep(_setUpTriangles, numTriangles, SCHEDULE_GUIDED, kSetUpChunkSize,
+                        stepsRemaining--);
+        fRecordingStats.setUpCycles += get_cycle_count() - setUpStartTime;
         fBaseSequenceNumber += numTriangles;
     }
 
-    // Pixel phase.  Shade the pixels and write back.
-    if (fWireframeMode)
-        parallel_execute(_wireframeTile, this, fTileColumns * fTileRows);
-    else
-        parallel_execute(_fillTile, this, fTileColumns * fTileRows);
+    fRecordingStats.numDraws = numDraws;
+    fRecordingStats.numTriangles = fBaseSequenceNumber;
+    for (int i = 0; i < kMaxThreads; i++)
+    {
+        fRecordingStats.numFrustumCulledTriangles += fThreadStats[i].frustumCulledTriangles;
+        fRecordingStats.numBackfaceCulledTriangles += fThreadStats[i].backfaceCulledTriangles;
+        fRecordingStats.numBinnedTriangles += fThreadStats[i].binnedTriangles;
+    }
+
+    if (fProfiling)
+    {
+        fRecordingStats.geometryL2Misses = read_perf_counter(kL2MissCounter) - startL2Misses;
+        fRecordingStats.geometryDCacheMisses = read_perf_counter(kDCacheMissCounter)
+                                               - startDCacheMisses;
+    }
 
 #if DISPLAY_STATS
     printf("total triangles = %d\n", fBaseSequenceNumber);
-    printf("used %zu bytes\n", fAllocator.bytesUsed());
 #endif
+}
+
+//
+// Run one step of the geometry phase. Each step picks a schedule for its
+// items. Vertex batches are expensive, so they are handed out one at a
+// time. Triangles are cheap and numerous, so setup hands them out in
+// shrinking ranges.
+//
+// If a previous frame is waiting for its pixel phase, hand out a share of
+// its tiles after the geometry jobs, so threads that run out of geometry
+// work fill tiles instead of waiting for the step to finish. In that case,
+// geometry items are grouped into fixed ranges of chunkSize, so each tile
+// is still its own job.
+//
+void RenderContext::runGeometryStep(parallel_range_func_t func, int numItems,
+                                    parallel_schedule schedule, int chunkSize, int stepsRemaining)
+{
+    int numTileJobs = 0;
+    if (fPixelFramePending)
+    {
+        numTileJobs = (fPixelFrame.numTiles - fPixelFrame.nextTile + stepsRemaining - 1)
+                      / stepsRemaining;
+    }
+
+    if (numTileJobs == 0)
+    {
+        parallel_execute_range(func, this, numItems, schedule, chunkSize);
+        return;
+    }
+
+    fGeometryFunc = func;
+    fGeometryChunkSize = chunkSize;
+    fNumGeometryItems = numItems;
+    fNumGeometryJobs = (numItems + chunkSize - 1) / chunkSize;
+    parallel_execute(_pipelinedJob, this, fNumGeometryJobs + numTileJobs);
+    fPixelFrame.nextTile += numTileJobs;
+}
 
-    // Clean up memory
-    // First reset draw queue to clean up, then allocator, which frees
-    // memory it is using.
+//
+// Capture the state the pixel phase needs and reset recording state for
+// the next frame.
+//
+void RenderContext::beginPixelPhase()
+{
+    fPixelFrame.allocator = fAllocator;
+    fPixelFrame.tiles = fTiles;
+    fPixelFrame.target = *fRenderTarget;
+    fPixelFrame.fbWidth = fFbWidth;
+    fPixelFrame.fbHeight = fFbHeight;
+    fPixelFrame.tileColumns = fTileColumns;
+    fPixelFrame.numTiles = fTileColumns * fTileRows;
+    fPixelFrame.nextTile = 0;
+    unsigned int sortStartTime = get_cycle_count();
+    orderTilesByCost();
+    fRecordingStats.sortCycles = get_cycle_count() - sortStartTime;
+    fPixelFrame.clearColorBuffer = fClearColorBuffer;
+    fPixelFrame.clearColor = fClearColor;
+    fPixelFrame.wireframeMode = fWireframeMode;
+    fPixelFrame.queries = fFrameQueries;
+    fPixelFrame.stats = fRecordingStats;
+    fPixelFrame.profiling = fProfiling;
+    if (fProfiling)
+    {
+        fPixelFrame.startL2Misses = read_perf_counter(kL2MissCounter);
+        fPixelFrame.startDCacheMisses = read_perf_counter(kDCacheMissCounter);
+    }
+
+    for (int i = 0; i < kMaxThreads; i++)
+    {
+        fThreadStats[i].occludedTriangles = 0;
+        fThreadStats[i].fillCycles = 0;
+        fThreadStats[i].flushCycles = 0;
+    }
+
+    fPixelFramePending = true;
+
+    // Triangles still point to render states in the draw queue, but the
+    // memory stays valid until the allocator is reset.
     fDrawQueue.reset();
-    fAllocator.reset();
+    fTiles = nullptr;
+    fTileTriangleCounts = nullptr;
+    fFrameQueries = nullptr;
+    fFrameNumber++;
     fCurrentState.fUniforms = nullptr;	// Remove dangling pointer
+    fCurrentState.fUniformSize = 0;
     fClearColorBuffer = false;
+    fRecordingStats = FrameStats();
+}
+
+//
+// Sort the tiles of the frame so the ones with the most triangles are
+// dispatched first. In raster order, a heavy tile near the end of the frame
+// can start when the other threads are almost done, and they wait idle for
+// it to finish. This is a counting sort on the log2 of each tile's triangle
+// count, which is cheap and close enough to balance the load. Tiles within
+// a bucket stay in raster order.
+//
+void RenderContext::orderTilesByCost()
+{
+    const int kNumBuckets = 33;
+    int numTiles = fPixelFrame.numTiles;
+    size_t arraySize = sizeof(int) * static_cast<unsigned int>(numTiles);
+    int *tileCounts = static_cast<int*>(fAllocator->alloc(arraySize));
+    int *order = static_cast<int*>(fAllocator->alloc(arraySize));
+    int bucketSizes[kNumBuckets];
+    int nextSlot[kNumBuckets];
+
+    for (int bucket = 0; bucket < kNumBuckets; bucket++)
+        bucketSizes[bucket] = 0;
+
+    for (int tile = 0; tile < numTiles; tile++)
+    {
+        int count = 0;
+        for (int thread = 0; thread < kMaxThreads; thread++)
+            count += fTileTriangleCounts[thread * numTiles + tile];
+
+        tileCounts[tile] = count;
+        bucketSizes[getCostBucket(count)]++;
+    }
+
+    int slot = 0;
+    for (int bucket = kNumBuckets - 1; bucket >= 0; bucket--)
+    {
+        nextSlot[bucket] = slot;
+        slot += bucketSizes[bucket];
+    }
+
+    for (int tile = 0; tile < numTiles; tile++)
+        order[nextSlot[getCostBucket(tileCounts[tile])]++] = tile;
+
+    fPixelFrame.tileOrder = order;
+    fPixelFrame.tileTriangleCounts = tileCounts;
+}
+
+//
+// Fill in the stats for the frame that just finished. This must be called
+// before the frame's allocator is reset.
+//
+void RenderContext::resolveFrameStats()
+{
+    FrameStats &stats = fPixelFrame.stats;
+    for (int i = 0; i < kMaxThreads; i++)
+    {
+        stats.numOccludedTriangles += fThreadStats[i].occludedTriangles;
+        stats.fillCycles += fThreadStats[i].fillCycles;
+        stats.flushCycles += fThreadStats[i].flushCycles;
+    }
+
+    if (fPixelFrame.profiling)
+    {
+        stats.pixelL2Misses = read_perf_counter(kL2MissCounter) - fPixelFrame.startL2Misses;
+        stats.pixelDCacheMisses = read_perf_counter(kDCacheMissCounter)
+                                  - fPixelFrame.startDCacheMisses;
+    }
+
+    // The tile counts are in frame memory. Copy them somewhere that lasts
+    // until the next frame finishes.
+    int numTiles = fPixelFrame.numTiles;
+    if (numTiles > fNumStatsTiles)
+    {
+        delete [] fStatsTileCounts;
+        fStatsTileCounts = new int[numTiles];
+        fNumStatsTiles = numTiles;
+    }
+
+    memcpy(fStatsTileCounts, fPixelFrame.tileTriangleCounts,
+           sizeof(int) * static_cast<unsigned int>(numTiles));
+    stats.tileTriangleCounts = fStatsTileCounts;
+    stats.tileColumns = fPixelFrame.tileColumns;
+    stats.tileRows = numTiles / fPixelFrame.tileColumns;
+    fFrameStats = stats;
+}
+
+void RenderContext::pixelJob(int index)
+{
+    int tile = fPixelFrame.tileOrder[index];
+    if (fPixelFrame.wireframeMode)
+        wireframeTile(tile);
+    else
+        fillTile(tile);
 }
 
 //
 // Compute vertex parameters.  This shades all vertices in the attribute array,
-// even if they are not referenced by the index array.
+// even if they are not referenced by the index array (see
+// shadeIndexedVertices).
 //
 void RenderContext::shadeVertices(int index)
 {
-    const RenderState &state = *fRenderCommandIterator;
-    int numVertices = state.fVertexAttrBuffer->getNumElements() - index * 16;
+    const DrawCommand &command = *fRenderCommandIterator;
+    const RenderState &state = *command.state;
+    int verticesPerInstance = state.fVertexAttrBuffer->getNumElements();
+    int numVertices = verticesPerInstance * state.fNumInstances - index * 16;
     vmask_t mask;
     if (numVertices < 16)
         mask = (1 << numVertices) - 1;
@@ -157,21 +635,168 @@ void RenderContext::shadeVertices(int index)
         mask = 0xffff;
 
     int attribsPerVertex = state.fShader->getNumAttribs();
-    vecf16_t packedAttribs[attribsPerVertex];
+    int instanceAttribs = state.fShader->getNumInstanceAttribs();
+    vecf16_t packedAttribs[attribsPerVertex + instanceAttribs];
     int startIndex = index * 16;
+    veci16_t instanceIndices = veci16_t(0);
+    if (state.fNumInstances == 1)
+    {
+        for (int attrib = 0; attrib < attribsPerVertex; attrib++)
+        {
+            packedAttribs[attrib] = vecf16_t(state.fVertexAttrBuffer->gatherElements(startIndex,
+                                             attrib, mask));
+        }
+    }
+    else
+    {
+        // The batch may span several instances. Lanes that run past the
+        // end of the vertex array wrap around to the start of the next
+        // instance.
+        const veci16_t kLaneVector = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+        veci16_t vertexIndices = kLaneVector + startIndex % verticesPerInstance;
+        instanceIndices = veci16_t(startIndex / verticesPerInstance);
+        while (true)
+        {
+            int wrapped = __builtin_nyuzi_mask_cmpi_sge(vertexIndices,
+                          veci16_t(verticesPerInstance)) & mask;
+            if (wrapped == 0)
+                break;
+
+            vertexIndices = __builtin_nyuzi_vector_mixi(wrapped, vertexIndices
+                            - verticesPerInstance, vertexIndices);
+            instanceIndices = __builtin_nyuzi_vector_mixi(wrapped, instanceIndices + 1,
+                              instanceIndices);
+        }
+
+        for (int attrib = 0; attrib < attribsPerVertex; attrib++)
+        {
+            packedAttribs[attrib] = vecf16_t(state.fVertexAttrBuffer->gatherElements(
+                                             vertexIndices, attrib, mask));
+        }
+    }
+
+    for (int attrib = 0; attrib < instanceAttribs; attrib++)
+    {
+        packedAttribs[attribsPerVertex + attrib] = vecf16_t(
+                    state.fInstanceAttrBuffer->gatherElements(instanceIndices, attrib, mask));
+    }
+
+    int paramsPerVertex = state.fShader->getNumParams();
+    vecf16_t packedParams[paramsPerVertex];
+    state.fShader->shadeVertices(packedParams, packedAttribs, state.fUniforms, mask);
+
+    const veci16_t kStepVector = { 0, 4, 8, 12, 16, 20, 24, 28, 32, 36, 40, 44, 48, 52, 56, 60 };
+    const veci16_t paramStepVector = kStepVector * paramsPerVertex;
+    float *outBuf = command.vertexParams + paramsPerVertex * index * 16;
+    veci16_t paramPtr = paramStepVector + reinterpret_cast<int>(outBuf);
+    for (int param = 0; param < paramsPerVertex; param++)
+    {
+        __builtin_nyuzi_scatter_storef_masked(paramPtr, packedParams[param], mask);
+        paramPtr += 4;
+    }
+}
+
+//
+// Start a new generation of the vertex slot table for an indexed draw,
+// which invalidates the entries of earlier draws without touching them.
+// The table only has to be cleared when it grows, or when the generation
+// counter wraps around.
+//
+void RenderContext::beginVertexSlotGeneration(int numVertices)
+{
+    if (numVertices > fVertexSlotTableSize || fVertexSlotGeneration == 0x7fffffff)
+    {
+        if (numVertices > fVertexSlotTableSize)
+        {
+            delete [] fVertexSlots;
+            fVertexSlots = new VertexSlot[numVertices];
+            fVertexSlotTableSize = numVertices;
+        }
+
+        memset(fVertexSlots, 0, sizeof(VertexSlot) * static_cast<unsigned int>(
+                   fVertexSlotTableSize));
+        fVertexSlotGeneration = 0;
+    }
+
+    fVertexSlotGeneration++;
+}
+
+//
+// Compute vertex parameters for vertices referenced by a batch of 16
+// indices. Each vertex is only shaded by the first batch that references
+// it. The shaded vertices are packed into vertexParams and fVertexSlots
+// records where each one went so setUpTriangle can find it.
+//
+void RenderContext::shadeIndexedVertices(int index)
+{
+    const DrawCommand &command = *fRenderCommandIterator;
+    const RenderState &state = *command.state;
+    const int *indices = static_cast<const int*>(state.fIndexBuffer->getData());
+    int indicesPerInstance = state.fIndexBuffer->getNumElements();
+    int verticesPerInstance = state.fVertexAttrBuffer->getNumElements();
+    int startIndex = index * 16;
+    int numIndices = min(indicesPerInstance * state.fNumInstances - startIndex, 16);
+    int instance = startIndex / indicesPerInstance;
+    int position = startIndex - instance * indicesPerInstance;
+
+    // Claim vertices that haven't been shaded yet. This also removes
+    // duplicates within the batch, since only the first claim succeeds.
+    // Each instance has its own copy of every vertex.
+    veci16_t vertexIndices = veci16_t(0);
+    veci16_t instanceIndices = veci16_t(0);
+    veci16_t slotIndices = veci16_t(0);
+    int numUnique = 0;
+    for (int i = 0; i < numIndices; i++)
+    {
+        int slotIndex = instance * verticesPerInstance + indices[position];
+        int *generation = &fVertexSlots[slotIndex].generation;
+        int oldGeneration = *generation;
+        if (oldGeneration != fVertexSlotGeneration
+                && __sync_bool_compare_and_swap(generation, oldGeneration, fVertexSlotGeneration))
+        {
+            vertexIndices[numUnique] = indices[position];
+            instanceIndices[numUnique] = instance;
+            slotIndices[numUnique] = slotIndex;
+            numUnique++;
+        }
+
+        if (++position == indicesPerInstance)
+        {
+            position = 0;
+            instance++;
+        }
+    }
+
+    if (numUnique == 0)
+        return;
+
+    int baseSlot = __sync_fetch_and_add(&fNumShadedVertices, numUnique);
+    for (int i = 0; i < numUnique; i++)
+        fVertexSlots[slotIndices[i]].slot = baseSlot + i;
+
+    vmask_t mask = static_cast<vmask_t>((1 << numUnique) - 1);
+    int attribsPerVertex = state.fShader->getNumAttribs();
+    int instanceAttribs = state.fShader->getNumInstanceAttribs();
+    vecf16_t packedAttribs[attribsPerVertex + instanceAttribs];
     for (int attrib = 0; attrib < attribsPerVertex; attrib++)
     {
-        packedAttribs[attrib] = vecf16_t(state.fVertexAttrBuffer->gatherElements(startIndex,
+        packedAttribs[attrib] = vecf16_t(state.fVertexAttrBuffer->gatherElements(vertexIndices,
                                          attrib, mask));
     }
 
+    for (int attrib = 0; attrib < instanceAttribs; attrib++)
+    {
+        packedAttribs[attribsPerVertex + attrib] = vecf16_t(
+                    state.fInstanceAttrBuffer->gatherElements(instanceIndices, attrib, mask));
+    }
+
     int paramsPerVertex = state.fShader->getNumParams();
     vecf16_t packedParams[paramsPerVertex];
     state.fShader->shadeVertices(packedParams, packedAttribs, state.fUniforms, mask);
 
     const veci16_t kStepVector = { 0, 4, 8, 12, 16, 20, 24, 28, 32, 36, 40, 44, 48, 52, 56, 60 };
     const veci16_t paramStepVector = kStepVector * paramsPerVertex;
-    float *outBuf = state.fVertexParams + paramsPerVertex * index * 16;
+    float *outBuf = command.vertexParams + paramsPerVertex * baseSlot;
     veci16_t paramPtr = paramStepVector + reinterpret_cast<int>(outBuf);
     for (int param = 0; param < paramsPerVertex; param++)
     {
@@ -185,6 +810,73 @@ namespace
 
 const float kNearWClip = 1.0;
 
+// Triangles are only clipped against the sides of the view frustum if they
+// extend past this guard band, in normalized device coordinates. Smaller
+// triangles are handled by the rasterizer, which only visits tiles that are
+// on screen. This keeps raster coordinates small enough that the edge
+// equations can't overflow.
+const float kGuardBand = 8.0;
+const int kMaxClipVertices = 9;	// 3 + one for each clip plane, plus one spare
+
+enum ClipPlane
+{
+    kClipNear = 1,
+    kClipLeft = 2,
+    kClipRight = 4,
+    kClipBottom = 8,
+    kClipTop = 16
+};
+
+const int kGuardBandPlanes = kClipLeft | kClipRight | kClipBottom | kClipTop;
+
+int clipOutcode(const float *params)
+{
+    float guardW = params[kParamW] * kGuardBand;
+    return (params[kParamW] < kNearWClip ? kClipNear : 0)
+           | (params[kParamX] < -guardW ? kClipLeft : 0)
+           | (params[kParamX] > guardW ? kClipRight : 0)
+           | (params[kParamY] < -guardW ? kClipBottom : 0)
+           | (params[kParamY] > guardW ? kClipTop : 0);
+}
+
+// Signed distance from a clip plane in homogeneous coordinates. Positive
+// values are inside.
+float planeDistance(const float *params, ClipPlane plane)
+{
+    switch (plane)
+    {
+    case kClipNear:
+        return params[kParamW] - kNearWClip;
+    case kClipLeft:
+        return params[kParamX] + params[kParamW] * kGuardBand;
+    case kClipRight:
+        return params[kParamW] * kGuardBand - params[kParamX];
+    case kClipBottom:
+        return params[kParamY] + params[kParamW] * kGuardBand;
+    case kClipTop:
+        return params[kParamW] * kGuardBand - params[kParamY];
+    }
+
+    return 0.0;
+}
+
+const veci16_t kLaneIndex = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+// Check an edge against a row of up to 16 tiles. Each lane of tileLeft is
+// the left coordinate of one tile. Returns a mask of the tiles that are
+// completely outside the edge. This uses the same reject corner test as
+// the rasterizer and assumes counterclockwise winding.
+inline vmask_t edgeRejectedTiles(veci16_t tileLeft, int tileTop, int x1, int y1,
+                                 int x2, int y2)
+{
+    // Find a reject corner
+    veci16_t cx = y2 > y1 ? tileLeft + kTileSize : tileLeft;
+    int cy = x2 > x1 ? tileTop : tileTop + kTileSize;
+
+    return __builtin_nyuzi_mask_cmpi_sgt(veci16_t((x2 - x1) * (cy - y1))
+                                         - (cx - x1) * (y2 - y1), veci16_t(0));
+}
+
 void interpolate(float *outParams, const float *inParams0, const float *inParams1, int numParams,
                  float distance)
 {
@@ -192,8 +884,164 @@ void interpolate(float *outParams, const float *inParams0, const float *inParams
         outParams[i] = inParams0[i] * (1.0 - distance) + inParams1[i] * distance;
 }
 
+// Returns true if a bounding box is completely outside one plane of the
+// view frustum. This transforms the eight corners at once, one per lane.
+// There is no far plane, because the renderer doesn't clip against one.
+bool isBoxOutsideFrustum(const Vec3 &boundsMin, const Vec3 &boundsMax, const Matrix &mvpMatrix)
+{
+    const veci16_t kCornerBits = { 0, 1, 2, 3, 4, 5, 6, 7, 0, 0, 0, 0, 0, 0, 0, 0 };
+    const int kCornerLanes = 0xff;
+    vecf16_t corner[4];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        corner[axis] = __builtin_nyuzi_vector_mixf(__builtin_nyuzi_mask_cmpi_ne(
+                           kCornerBits & (1 << axis), veci16_t(0)),
+                       vecf16_t(boundsMax[axis]), vecf16_t(boundsMin[axis]));
+    }
+
+    corner[3] = 1.0f;
+    vecf16_t clip[4];
+    mvpMatrix.mulVec(clip, corner);
+
+    vecf16_t w = clip[kParamW];
+    vecf16_t negW = -w;
+    int outside[5] =
+    {
+        __builtin_nyuzi_mask_cmpf_lt(w, vecf16_t(kNearWClip)),
+        __builtin_nyuzi_mask_cmpf_lt(clip[kParamX], negW),
+        __builtin_nyuzi_mask_cmpf_gt(clip[kParamX], w),
+        __builtin_nyuzi_mask_cmpf_lt(clip[kParamY], negW),
+        __builtin_nyuzi_mask_cmpf_gt(clip[kParamY], w)
+    };
+
+    for (int plane = 0; plane < 5; plane++)
+    {
+        if ((outside[plane] & kCornerLanes) == kCornerLanes)
+            return true;
+    }
+
+    return false;
+}
+
+// A query without a result yet doesn't hide anything.
+bool wasOccluded(const OcclusionQuery *query)
+{
+    return query->isResultAvailable() && query->getSamplesPassed() == 0;
+}
+
 } // namespace
 
+bool RenderContext::drawElements(const RenderBuffer *indices, const Vec3 &boundsMin,
+                                 const Vec3 &boundsMax, const Matrix &mvpMatrix)
+{
+    if (fRecordingBuffer)
+    {
+        drawElements(indices);
+
+        // Fill in the bounds of the draw call that was just recorded.
+        CommandBuffer::RecordedDraw &draw = *fRecordingBuffer->fDraws.end().prev();
+        draw.hasBounds = true;
+        draw.boundsMin = boundsMin;
+        draw.boundsMax = boundsMax;
+        draw.boundsMatrix = mvpMatrix;
+        return true;
+    }
+
+    if (isBoxOutsideFrustum(boundsMin, boundsMax, mvpMatrix))
+    {
+        fRecordingStats.numFrustumCulledDraws++;
+        return false;
+    }
+
+    drawElements(indices);
+    return true;
+}
+
+void RenderContext::beginCommandBuffer(CommandBuffer *buffer)
+{
+    assert(fRecordingBuffer == nullptr);
+    buffer->reset();
+    fRecordingBuffer = buffer;
+
+    // The currently bound uniforms belong to the frame, which may be gone
+    // by the time the buffer is executed. Give the buffer its own copy.
+    if (fCurrentState.fUniforms)
+        bindUniforms(fCurrentState.fUniforms, fCurrentState.fUniformSize);
+}
+
+void RenderContext::endCommandBuffer()
+{
+    assert(fRecordingBuffer != nullptr);
+    fRecordingBuffer = nullptr;
+
+    // Move the uniforms back to frame memory, so patching the buffer
+    // doesn't affect draw calls issued after this.
+    if (fCurrentState.fUniforms)
+        bindUniforms(fCurrentState.fUniforms, fCurrentState.fUniformSize);
+}
+
+void RenderContext::executeCommandBuffer(const CommandBuffer *buffer, const Matrix *cullMatrix)
+{
+    assert(buffer != fRecordingBuffer);
+    for (const CommandBuffer::RecordedDraw &draw : buffer->fDraws)
+    {
+        if (draw.condition && wasOccluded(draw.condition))
+        {
+            fRecordingStats.numOccludedDraws++;
+            continue;
+        }
+
+        if (cullMatrix && draw.hasBounds && isBoxOutsideFrustum(draw.boundsMin,
+                draw.boundsMax, *cullMatrix * draw.boundsMatrix))
+        {
+            fRecordingStats.numFrustumCulledDraws++;
+            continue;
+        }
+
+        appendDraw(&draw.state);
+    }
+}
+
+bool RenderContext::drawElementsConditional(const RenderBuffer *indices,
+        const OcclusionQuery *query)
+{
+    if (fRecordingBuffer)
+    {
+        drawElements(indices);
+        (*fRecordingBuffer->fDraws.end().prev()).condition = query;
+        return true;
+    }
+
+    if (wasOccluded(query))
+    {
+        fRecordingStats.numOccludedDraws++;
+        return false;
+    }
+
+    drawElements(indices);
+    return true;
+}
+
+bool RenderContext::drawElementsConditional(const RenderBuffer *indices,
+        const OcclusionQuery *query, const Vec3 &boundsMin, const Vec3 &boundsMax,
+        const Matrix &mvpMatrix)
+{
+    if (fRecordingBuffer)
+    {
+        drawElements(indices, boundsMin, boundsMax, mvpMatrix);
+        (*fRecordingBuffer->fDraws.end().prev()).condition = query;
+        return true;
+    }
+
+    if (wasOccluded(query))
+    {
+        fRecordingStats.numOccludedDraws++;
+        return false;
+    }
+
+    return drawElements(indices, boundsMin, boundsMax, mvpMatrix);
+}
+
 //
 // Clip a triangle where one vertex is past the near clip plane.
 // The clipped vertex is always params0.  This creates two new triangles above
@@ -255,25 +1103,135 @@ void RenderContext::clipTwo(int sequence, const RenderState &state, const float
     enqueueTriangle(sequence, state, newPoint2, newPoint1, params2);
 }
 
+//
+// Clip a triangle against each plane in clipPlanes using Sutherland-Hodgman
+// in homogeneous coordinates, then split the resulting convex polygon into a
+// fan of triangles. This is slower than clipOne/clipTwo, but only occurs for
+// triangles that extend outside the guard band.
+//
+
+void RenderContext::clipPolygon(int sequence, const RenderState &state, const float *params0,
+                                const float *params1, const float *params2, int clipPlanes)
+{
+    float vertexBuf[2][kMaxClipVertices][kMaxParams];
+    const float *polygon[2][kMaxClipVertices];
+    int numVertices = 3;
+    int current = 0;
+    polygon[0][0] = params0;
+    polygon[0][1] = params1;
+    polygon[0][2] = params2;
+
+    for (int plane = kClipNear; plane <= kClipTop; plane <<= 1)
+    {
+        if ((clipPlanes & plane) == 0)
+            continue;
+
+        ClipPlane clipPlane = static_cast<ClipPlane>(plane);
+        const float * const *inPolygon = polygon[current];
+        const float **outPolygon = polygon[current ^ 1];
+        int numOut = 0;
+        const float *prev = inPolygon[numVertices - 1];
+        float prevDistance = planeDistance(prev, clipPlane);
+        for (int i = 0; i < numVertices; i++)
+        {
+            const float *vertex = inPolygon[i];
+            float distance = planeDistance(vertex, clipPlane);
+            if ((prevDistance >= 0) != (distance >= 0))
+            {
+                // Edge crosses the plane, add the intersection.
+                float *newVertex = vertexBuf[current ^ 1][numOut];
+                interpolate(newVertex, prev, vertex, state.fParamsPerVertex,
+                            prevDistance / (prevDistance - distance));
+                outPolygon[numOut++] = newVertex;
+            }
+
+            if (distance >= 0)
+            {
+                // Inside vertices may live in the buffer this pass writes
+                // new vertices into, so copy them.
+                float *newVertex = vertexBuf[current ^ 1][numOut];
+                memcpy(newVertex, vertex, sizeof(float) * static_cast<unsigned int>(
+                           state.fParamsPerVertex));
+                outPolygon[numOut++] = newVertex;
+            }
+
+            prev = vertex;
+            prevDistance = distance;
+        }
+
+        numVertices = numOut;
+        current ^= 1;
+        if (numVertices < 3)
+        {
+            fThreadStats[get_current_thread_id()].frustumCulledTriangles++;
+            return;
+        }
+    }
+
+    for (int i = 1; i < numVertices - 1; i++)
+    {
+        enqueueTriangle(sequence, state, polygon[current][0], polygon[current][i],
+                        polygon[current][i + 1]);
+    }
+}
+
 void RenderContext::setUpTriangle(int triangleIndex)
 {
-    RenderState &state = *fRenderCommandIterator;
+    const DrawCommand &command = *fRenderCommandIterator;
+    const RenderState &state = *command.state;
     int vertexIndex = triangleIndex * 3;
+    int vertexBase = 0;
+    if (state.fNumInstances > 1)
+    {
+        // Find the vertices of this instance (see runGeometryPhase)
+        int trianglesPerInstance = state.fIndexBuffer->getNumElements() / 3;
+        int instance = triangleIndex / trianglesPerInstance;
+        vertexIndex = (triangleIndex - instance * trianglesPerInstance) * 3;
+        vertexBase = instance * state.fVertexAttrBuffer->getNumElements();
+    }
+
     const int *indices = static_cast<const int*>(state.fIndexBuffer->getData());
-    int offset0 = indices[vertexIndex] * state.fParamsPerVertex;
-    int offset1 = indices[vertexIndex + 1] * state.fParamsPerVertex;
-    int offset2 = indices[vertexIndex + 2] * state.fParamsPerVertex;
-    const float *params0 = &state.fVertexParams[offset0];
-    const float *params1 = &state.fVertexParams[offset1];
-    const float *params2 = &state.fVertexParams[offset2];
+    int vertex0 = indices[vertexIndex] + vertexBase;
+    int vertex1 = indices[vertexIndex + 1] + vertexBase;
+    int vertex2 = indices[vertexIndex + 2] + vertexBase;
+    if (state.fIndexedVertexShading)
+    {
+        vertex0 = fVertexSlots[vertex0].slot;
+        vertex1 = fVertexSlots[vertex1].slot;
+        vertex2 = fVertexSlots[vertex2].slot;
+    }
+
+    int offset0 = vertex0 * state.fParamsPerVertex;
+    int offset1 = vertex1 * state.fParamsPerVertex;
+    int offset2 = vertex2 * state.fParamsPerVertex;
+    const float *params0 = &command.vertexParams[offset0];
+    const float *params1 = &command.vertexParams[offset1];
+    const float *params2 = &command.vertexParams[offset2];
+
+    // Reject triangles that are completely outside one clip plane. If any
+    // vertex is outside the guard band, perform full homogeneous clipping.
+    int outcode0 = clipOutcode(params0);
+    int outcode1 = clipOutcode(params1);
+    int outcode2 = clipOutcode(params2);
+    if (outcode0 & outcode1 & outcode2)
+    {
+        fThreadStats[get_current_thread_id()].frustumCulledTriangles++;
+        return;
+    }
+
+    int clipPlanes = outcode0 | outcode1 | outcode2;
+    if (clipPlanes & kGuardBandPlanes)
+    {
+        clipPolygon(fBaseSequenceNumber + triangleIndex, state, params0, params1, params2,
+                    clipPlanes);
+        return;
+    }
 
     // Determine which point (if any) are clipped against the near plane, call
-    // appropriate clip routine with triangle rotated appropriately. We don't
-    // clip against other planes.
-    // XXX This is not quite correct; it needs to perform homogenous clipping.  Also,
-    // the viewing volume is zNear = -1, zFar = -inf
-    int clipMask = (params0[kParamW] < kNearWClip ? 1 : 0) | (params1[kParamW] < kNearWClip ? 2 : 0)
-                   | (params2[kParamW] < kNearWClip ? 4 : 0);
+    // appropriate clip routine with triangle rotated appropriately.
+    // XXX the viewing volume is zNear = -1, zFar = -inf
+    int clipMask = (outcode0 & kClipNear ? 1 : 0) | (outcode1 & kClipNear ? 2 : 0)
+                   | (outcode2 & kClipNear ? 4 : 0);
     switch (clipMask)
     {
     case 0:
@@ -310,6 +1268,23 @@ void RenderContext::setUpTriangle(int triangleIndex)
     }
 }
 
+//
+// Reserve a triangle in the thread's current block, allocating a new block
+// when it is full. Triangles are allocated 16 at a time, so the cache line
+// alignment of each block doesn't waste space after every triangle.
+//
+RenderContext::Triangle *RenderContext::allocateTriangle(int threadId)
+{
+    if (fNextTriangleSlot[threadId] == 16)
+    {
+        fCurrentTriangleBlock[threadId] = static_cast<Triangle*>(fAllocator->alloc(
+                                              sizeof(Triangle) * 16, kCacheLineSize));
+        fNextTriangleSlot[threadId] = 0;
+    }
+
+    return fCurrentTriangleBlock[threadId] + fNextTriangleSlot[threadId]++;
+}
+
 //
 // Performs the second half of triangle setup after clipping: perspective
 // division, backface culling, and binning.
@@ -318,179 +1293,243 @@ void RenderContext::setUpTriangle(int triangleIndex)
 void RenderContext::enqueueTriangle(int sequence, const RenderState &state, const float *params0,
                                     const float *params1, const float *params2)
 {
-    Triangle tri;
-    tri.sequenceNumber = sequence;
-    tri.state = &state;
+    int threadId = get_current_thread_id();
+    assert(threadId < kMaxThreads);
+    ThreadStats &threadStats = fThreadStats[threadId];
 
     // Perform perspective division.
     // XXX Z should be divided against W here.  This is a bit of a hack.
     float oneOverW0 = 1.0 / params0[kParamW];
     float oneOverW1 = 1.0 / params1[kParamW];
     float oneOverW2 = 1.0 / params2[kParamW];
-    tri.x0 = params0[kParamX] * oneOverW0;
-    tri.y0 = params0[kParamY] * oneOverW0;
-    tri.z0 = params0[kParamZ];
-    tri.x1 = params1[kParamX] * oneOverW1;
-    tri.y1 = params1[kParamY] * oneOverW1;
-    tri.z1 = params1[kParamZ];
-    tri.x2 = params2[kParamX] * oneOverW2;
-    tri.y2 = params2[kParamY] * oneOverW2;
-    tri.z2 = params2[kParamZ];
+    float x0 = params0[kParamX] * oneOverW0;
+    float y0 = params0[kParamY] * oneOverW0;
+    float x1 = params1[kParamX] * oneOverW1;
+    float y1 = params1[kParamY] * oneOverW1;
+    float x2 = params2[kParamX] * oneOverW2;
+    float y2 = params2[kParamY] * oneOverW2;
 
     // Convert screen space coordinates to raster coordinates
     int halfWidth = fFbWidth / 2;
     int halfHeight = fFbHeight / 2;
-    tri.x0Rast = tri.x0 * halfWidth + halfWidth;
-    tri.y0Rast = -tri.y0 * halfHeight + halfHeight;
-    tri.x1Rast = tri.x1 * halfWidth + halfWidth;
-    tri.y1Rast = -tri.y1 * halfHeight + halfHeight;
-    tri.x2Rast = tri.x2 * halfWidth + halfWidth;
-    tri.y2Rast = -tri.y2 * halfHeight + halfHeight;
-
-    int winding = (tri.x1Rast - tri.x0Rast) * (tri.y2Rast - tri.y0Rast) - (tri.y1Rast - tri.y0Rast)
-                  * (tri.x2Rast - tri.x0Rast);
+    int x0Rast = getRasterX(x0, halfWidth);
+    int y0Rast = getRasterY(y0, halfHeight);
+    int x1Rast = getRasterX(x1, halfWidth);
+    int y1Rast = getRasterY(y1, halfHeight);
+    int x2Rast = getRasterX(x2, halfWidth);
+    int y2Rast = getRasterY(y2, halfHeight);
+
+    int winding = (x1Rast - x0Rast) * (y2Rast - y0Rast) - (y1Rast - y0Rast)
+                  * (x2Rast - x0Rast);
     if (winding == 0)
-        return;	// remove edge-on triangles, which won't be rasterized correctly.
+    {
+        // remove edge-on triangles, which won't be rasterized correctly.
+        threadStats.backfaceCulledTriangles++;
+        return;
+    }
 
-    tri.woundCCW = winding < 0;
+    bool woundCCW = winding < 0;
 
     // Backface culling
-    if ((state.cullingMode == RenderState::kCullCW && !tri.woundCCW)
-            || (state.cullingMode == RenderState::kCullCCW && tri.woundCCW))
+    if ((state.cullingMode == RenderState::kCullCW && !woundCCW)
+            || (state.cullingMode == RenderState::kCullCCW && woundCCW))
+    {
+        threadStats.backfaceCulledTriangles++;
         return;
+    }
 
     // Compute bounding box
-    int bbLeft = tri.x0Rast < tri.x1Rast ? tri.x0Rast : tri.x1Rast;
-    bbLeft = tri.x2Rast < bbLeft ? tri.x2Rast : bbLeft;
-    int bbTop = tri.y0Rast < tri.y1Rast ? tri.y0Rast : tri.y1Rast;
-    bbTop = tri.y2Rast < bbTop ? tri.y2Rast : bbTop;
-    int bbRight = tri.x0Rast > tri.x1Rast ? tri.x0Rast : tri.x1Rast;
-    bbRight = tri.x2Rast > bbRight ? tri.x2Rast : bbRight;
-    int bbBottom = tri.y0Rast > tri.y1Rast ? tri.y0Rast : tri.y1Rast;
-    bbBottom = tri.y2Rast > bbBottom ? tri.y2Rast : bbBottom;
+    int bbLeft = x0Rast < x1Rast ? x0Rast : x1Rast;
+    bbLeft = x2Rast < bbLeft ? x2Rast : bbLeft;
+    int bbTop = y0Rast < y1Rast ? y0Rast : y1Rast;
+    bbTop = y2Rast < bbTop ? y2Rast : bbTop;
+    int bbRight = x0Rast > x1Rast ? x0Rast : x1Rast;
+    bbRight = x2Rast > bbRight ? x2Rast : bbRight;
+    int bbBottom = y0Rast > y1Rast ? y0Rast : y1Rast;
+    bbBottom = y2Rast > bbBottom ? y2Rast : bbBottom;
 
     // Cull triangles that are outside the sides of the view frustum
     if (bbRight < 0 || bbLeft >= fFbWidth || bbBottom < 0 || bbTop >= fFbHeight)
+    {
+        threadStats.frustumCulledTriangles++;
         return;
+    }
 
-    // Copy parameters into triangle structure, skipping position which is already
-    // in x0/y0/z0/x1...
+    // Store the triangle once. Tile bins only reference it.
+    threadStats.binnedTriangles++;
+    Triangle *tri = allocateTriangle(threadId);
+    tri->x0 = x0;
+    tri->y0 = y0;
+    tri->z0 = params0[kParamZ];
+    tri->x1 = x1;
+    tri->y1 = y1;
+    tri->z1 = params1[kParamZ];
+    tri->x2 = x2;
+    tri->y2 = y2;
+    tri->z2 = params2[kParamZ];
+    tri->nearestZ = max(max(params0[kParamZ], params1[kParamZ]), params2[kParamZ]);
+    tri->state = &state;
+    tri->woundCCW = woundCCW;
+    BinEntry entry;
+    entry.sequenceNumber = sequence;
+    entry.triangle = tri;
+
+    // Copy parameters, skipping position which is already in x0/y0/z0/x1...
     unsigned int paramSize = sizeof(float) * static_cast<unsigned int>(state.fParamsPerVertex - 4);
-    float *params = static_cast<float*>(fAllocator.alloc(paramSize * 3));
+    float *params = static_cast<float*>(fAllocator->alloc(paramSize * 3));
     memcpy(params, params0 + 4, paramSize);
     memcpy(params + state.fParamsPerVertex - 4, params1 + 4, paramSize);
     memcpy(params + (state.fParamsPerVertex - 4) * 2, params2 + 4, paramSize);
-    tri.params = params;
+    tri->params = params;
 
-    // Determine which tiles this triangle may overlap with a simple
-    // bounding box check.  Enqueue it in the queues for each tile.
+    // Determine which tiles the bounding box of this triangle overlaps.
     int minTileX = max(bbLeft / kTileSize, 0);
     int maxTileX = min(bbRight / kTileSize, fTileColumns - 1);
     int minTileY = max(bbTop / kTileSize, 0);
     int maxTileY = min(bbBottom / kTileSize, fTileRows - 1);
-    for (int tiley = minTileY; tiley <= maxTileY; tiley++)
+    if (minTileX == maxTileX && minTileY == maxTileY)
     {
-        for (int tilex = minTileX; tilex <= maxTileX; tilex++)
-            fTiles[tiley * fTileColumns + tilex].append(tri);
+        // The triangle is entirely within one tile.
+        binTriangle(minTileY * fTileColumns + minTileX, threadId, entry);
+        return;
     }
-}
-
-namespace
-{
 
-// These assume counterclockwise winding
-bool edgeRejected(int left, int top, int right, int bottom,
-                  int x1, int y1, int x2, int y2)
-{
-    // Find a reject corner
-    int cx = y2 > y1 ? right : left;
-    int cy = x2 > x1 ? top : bottom;
-
-    return (x2 - x1) * (cy - y1) - (y2 - y1) * (cx - x1) > 0;
-}
-
-bool triangleRejected(int left, int top, int right, int bottom,
-                      int x1, int y1, int x2, int y2, int x3, int y3)
-{
-    return edgeRejected(left, top, right, bottom, x1, y1, x2, y2)
-           || edgeRejected(left, top, right, bottom, x2, y2, x3, y3)
-           || edgeRejected(left, top, right, bottom, x3, y3, x1, y1);
+    // Test the edges of the triangle against each candidate tile, 16 tiles
+    // at a time, and enqueue it in this thread's bin for each tile it
+    // actually overlaps. Long, thin, or diagonal triangles would otherwise
+    // end up in many tiles they don't touch.
+    int edgeX1 = x0Rast;
+    int edgeY1 = y0Rast;
+    int edgeX2 = woundCCW ? x1Rast : x2Rast;
+    int edgeY2 = woundCCW ? y1Rast : y2Rast;
+    int edgeX3 = woundCCW ? x2Rast : x1Rast;
+    int edgeY3 = woundCCW ? y2Rast : y1Rast;
+    for (int tiley = minTileY; tiley <= maxTileY; tiley++)
+    {
+        int tileTop = tiley * kTileSize;
+        for (int tilex = minTileX; tilex <= maxTileX; tilex += 16)
+        {
+            veci16_t tileLeft = (kLaneIndex + tilex) * kTileSize;
+            int numCandidates = min(maxTileX - tilex + 1, 16);
+            unsigned int overlapMask = ((1u << numCandidates) - 1)
+                                       & ~static_cast<unsigned int>(
+                                           edgeRejectedTiles(tileLeft, tileTop, edgeX1, edgeY1,
+                                                   edgeX2, edgeY2)
+                                           | edgeRejectedTiles(tileLeft, tileTop, edgeX2, edgeY2,
+                                                   edgeX3, edgeY3)
+                                           | edgeRejectedTiles(tileLeft, tileTop, edgeX3, edgeY3,
+                                                   edgeX1, edgeY1));
+            while (overlapMask)
+            {
+                int lane = __builtin_ctz(overlapMask);
+                overlapMask &= ~(1u << lane);
+                binTriangle(tiley * fTileColumns + tilex + lane, threadId, entry);
+            }
+        }
+    }
 }
 
-} // namespace
-
 void RenderContext::fillTile(int index)
 {
-    const int x = index % fTileColumns;
-    const int y = index / fTileColumns;
+    const int x = index % fPixelFrame.tileColumns;
+    const int y = index / fPixelFrame.tileColumns;
     const int tileX = x * kTileSize;
     const int tileY = y * kTileSize;
-    TriangleArray &tile = fTiles[y * fTileColumns + x];
-    Surface *colorBuffer = fRenderTarget->getColorBuffer();
+    Surface *colorBuffer = fPixelFrame.target.getColorBuffer();
+    Surface *depthBuffer = fPixelFrame.target.getDepthBuffer();
+    int threadId = get_current_thread_id();
+    ThreadStats &threadStats = fThreadStats[threadId];
+    unsigned int startTime = fPixelFrame.profiling ? get_cycle_count() : 0;
+
+    // Clears only record the clear value in the tile. Memory is written
+    // when a triangle first touches the tile, or when the tile is flushed.
+    if (colorBuffer && fPixelFrame.clearColorBuffer)
+        colorBuffer->fastClearTile(tileX, tileY, fPixelFrame.clearColor);
+
+    // A depth-only target is the output of the frame, so its depth buffer
+    // must be cleared even if nothing covers the tile. Otherwise, if no
+    // triangles overlap the tile, the depth buffer is never read.
+    bool tileEmpty = fPixelFrame.isTileEmpty(index);
+    if (tileEmpty && colorBuffer)
+    {
+        colorBuffer->flushDirtyTile(tileX, tileY);
+        if (fPixelFrame.profiling)
+            threadStats.flushCycles += get_cycle_count() - startTime;
 
-    if (fClearColorBuffer)
-        colorBuffer->clearTile(tileX, tileY, fClearColor);
+        return;
+    }
 
-    // Initialize Z-Buffer to -infinity
-    if (fRenderTarget->getDepthBuffer())
-        fRenderTarget->getDepthBuffer()->clearTile(tileX, tileY, 0xff800000);
+    TriangleFiller filler(&fPixelFrame.target);
 
-    // The triangles may have been reordered during the parallel vertex shading
-    // phase.  Put them back in the order they were submitted.
-    tile.sort();
+    // Initialize Z-Buffer to -infinity
+    if (depthBuffer)
+    {
+        depthBuffer->fastClearTile(tileX, tileY, depthBuffer->getDepthClearValue());
+        filler.resetCoarseDepth(tileX, tileY);
+    }
 
-    // Walk through all triangles that overlap this tile and render
-    TriangleFiller filler(fRenderTarget);
-    for (const Triangle &tri : tile)
+    // Triangles were set up in parallel by several threads. Merge the
+    // per-thread bins to walk through all triangles that overlap this tile
+    // in the order they were submitted, and render them.
+    int halfWidth = fPixelFrame.fbWidth / 2;
+    int halfHeight = fPixelFrame.fbHeight / 2;
+    QueueMerger<BinEntry, 64, kMaxThreads> merger(fPixelFrame.getTileBins(index));
+    while (const BinEntry *entry = merger.next())
     {
+        const Triangle &tri = *entry->triangle;
         const RenderState &state = *tri.state;
 
-        // Do a better check to see if this triangle overlaps the tile.
-        // If not, skip setting up interpolators.
-        if (tri.woundCCW)
+        // Skip triangles that are behind everything already drawn in
+        // this tile before doing any setup work.
+        if (state.fEnableDepthBuffer && filler.isTileOccluded(tri.nearestZ))
         {
-            if (triangleRejected(tileX, tileY, tileX + kTileSize,
-                                 tileY + kTileSize, tri.x0Rast, tri.y0Rast, tri.x1Rast,
-                                 tri.y1Rast, tri.x2Rast, tri.y2Rast))
-            {
-                continue;
-            }
-        }
-        else
-        {
-            if (triangleRejected(tileX, tileY, tileX + kTileSize,
-                                 tileY + kTileSize, tri.x0Rast, tri.y0Rast, tri.x2Rast,
-                                 tri.y2Rast, tri.x1Rast, tri.y1Rast))
-            {
-                continue;
-            }
+            threadStats.occludedTriangles++;
+            continue;
         }
 
         // Set up parameters and rasterize triangle.
         filler.setUpTriangle(&state, tri.x0, tri.y0, tri.z0, tri.x1, tri.y1, tri.z1, tri.x2,
                              tri.y2, tri.z2);
-        for (int paramI = 0; paramI < state.fParamsPerVertex; paramI++)
+        const float *params = tri.params;
+        int numParams = state.fParamsPerVertex - 4;
+        for (int paramI = 0; paramI < numParams; paramI++)
         {
-            filler.setUpParam(tri.params[paramI],
-                              tri.params[(state.fParamsPerVertex - 4) + paramI],
-                              tri.params[(state.fParamsPerVertex - 4) * 2 + paramI]);
+            filler.setUpParam(params[paramI], params[numParams + paramI],
+                              params[numParams * 2 + paramI]);
         }
 
+        int x0Rast = getRasterX(tri.x0, halfWidth);
+        int y0Rast = getRasterY(tri.y0, halfHeight);
+        int x1Rast = getRasterX(tri.x1, halfWidth);
+        int y1Rast = getRasterY(tri.y1, halfHeight);
+        int x2Rast = getRasterX(tri.x2, halfWidth);
+        int y2Rast = getRasterY(tri.y2, halfHeight);
         if (tri.woundCCW)
         {
-            fillTriangle(filler, tileX, tileY,
-                         tri.x0Rast, tri.y0Rast, tri.x1Rast, tri.y1Rast, tri.x2Rast, tri.y2Rast,
-                         fFbWidth, fFbHeight);
+            fillTriangle(filler, tileX, tileY, x0Rast, y0Rast, x1Rast, y1Rast, x2Rast, y2Rast,
+                         fPixelFrame.fbWidth, fPixelFrame.fbHeight);
         }
         else
         {
-            fillTriangle(filler, tileX, tileY,
-                         tri.x0Rast, tri.y0Rast, tri.x2Rast, tri.y2Rast, tri.x1Rast, tri.y1Rast,
-                         fFbWidth, fFbHeight);
+            fillTriangle(filler, tileX, tileY, x0Rast, y0Rast, x2Rast, y2Rast, x1Rast, y1Rast,
+                         fPixelFrame.fbWidth, fPixelFrame.fbHeight);
         }
+
+        if (state.fOcclusionQuery)
+            state.fOcclusionQuery->addSamples(threadId, filler.takeSamplesPassed());
     }
 
-    colorBuffer->flushTile(tileX, tileY);
+    unsigned int flushStartTime = fPixelFrame.profiling ? get_cycle_count() : 0;
+    if (colorBuffer)
+        colorBuffer->flushDirtyTile(tileX, tileY);
+    else
+        depthBuffer->resolveTile(tileX, tileY);
+
+    if (fPixelFrame.profiling)
+    {
+        threadStats.fillCycles += flushStartTime - startTime;
+        threadStats.flushCycles += get_cycle_count() - flushStartTime;
+    }
 }
 
 //
@@ -499,14 +1538,19 @@ void RenderContext::fillTile(int index)
 
 void RenderContext::wireframeTile(int index)
 {
-    const int x = index % fTileColumns;
-    const int y = index / fTileColumns;
+    const int x = index % fPixelFrame.tileColumns;
+    const int y = index / fPixelFrame.tileColumns;
     const int tileX = x * kTileSize;
     const int tileY = y * kTileSize;
-    const TriangleArray &tile = fTiles[y * fTileColumns + x];
+    const TriangleArray *bins = fPixelFrame.getTileBins(index);
+
+    Surface *colorBuffer = fPixelFrame.target.getColorBuffer();
+    if (colorBuffer == nullptr)
+        return;
 
-    Surface *colorBuffer = fRenderTarget->getColorBuffer();
-    colorBuffer->clearTile(tileX, tileY, fClearColor);
+    // As in fillTile, the clear is only written to memory when a line first
+    // touches the tile, or when the tile is flushed.
+    colorBuffer->fastClearTile(tileX, tileY, fPixelFrame.clearColor);
     int bottomClip = tileY + kTileSize - 1;
     int rightClip = tileX + kTileSize - 1;
     if (bottomClip >= colorBuffer->getHeight())
@@ -515,17 +1559,30 @@ void RenderContext::wireframeTile(int index)
     if (rightClip >= colorBuffer->getWidth())
         rightClip = colorBuffer->getWidth() - 1;
 
-    for (const Triangle &tri : tile)
+    // Drawing order doesn't matter here, so don't bother merging the bins.
+    int halfWidth = fPixelFrame.fbWidth / 2;
+    int halfHeight = fPixelFrame.fbHeight / 2;
+    for (int binIndex = 0; binIndex < kMaxThreads; binIndex++)
     {
-        drawLineClipped(colorBuffer, tri.x0Rast, tri.y0Rast, tri.x1Rast, tri.y1Rast, 0xffffffff,
-                        tileX, tileY, rightClip, bottomClip);
-        drawLineClipped(colorBuffer, tri.x1Rast, tri.y1Rast, tri.x2Rast, tri.y2Rast, 0xffffffff,
-                        tileX, tileY, rightClip, bottomClip);
-        drawLineClipped(colorBuffer, tri.x2Rast, tri.y2Rast, tri.x0Rast, tri.y0Rast, 0xffffffff,
-                        tileX, tileY, rightClip, bottomClip);
+        for (const BinEntry &entry : bins[binIndex])
+        {
+            const Triangle &tri = *entry.triangle;
+            int x0 = getRasterX(tri.x0, halfWidth);
+            int y0 = getRasterY(tri.y0, halfHeight);
+            int x1 = getRasterX(tri.x1, halfWidth);
+            int y1 = getRasterY(tri.y1, halfHeight);
+            int x2 = getRasterX(tri.x2, halfWidth);
+            int y2 = getRasterY(tri.y2, halfHeight);
+            drawLineBlocksClipped(colorBuffer, x0, y0, x1, y1, 0xffffffff, tileX, tileY,
+                                  rightClip, bottomClip);
+            drawLineBlocksClipped(colorBuffer, x1, y1, x2, y2, 0xffffffff, tileX, tileY,
+                                  rightClip, bottomClip);
+            drawLineBlocksClipped(colorBuffer, x2, y2, x0, y0, 0xffffffff, tileX, tileY,
+                                  rightClip, bottomClip);
+        }
     }
 
-    colorBuffer->flushTile(tileX, tileY);
+    colorBuffer->flushDirtyTile(tileX, tileY);
 }
 
 } // namespace librender
\ No newline at end of file
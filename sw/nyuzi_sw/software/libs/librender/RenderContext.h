@@ -17,7 +17,12 @@
 
 #pragma once
 
+#include <schedule.h>
+#include "CommandBuffer.h"
 #include "CommandQueue.h"
+#include "FrameStats.h"
+#include "Matrix.h"
+#include "OcclusionQuery.h"
 #include "RegionAllocator.h"
 #include "RenderState.h"
 #include "RenderTarget.h"
@@ -37,6 +42,7 @@ public:
     explicit RenderContext(unsigned int workingMemSize = 0x400000);
     RenderContext(const RenderContext&) = delete;
     RenderContext& operator=(const RenderContext&) = delete;
+    ~RenderContext();
 
     void setClearColor(float r, float g, float b);
 
@@ -71,6 +77,8 @@ public:
     // that are constant for all pixels.
     // XXX Unlike other state changes, this will be invalidated when finish()
     // is called. You will need to call it again for the next frame.
+    // While a command buffer is being recorded, the copy is stored in the
+    // command buffer instead, and stays valid until it is reset.
     void bindUniforms(const void *uniforms, size_t size);
 
     // If enabled is true, this will
@@ -89,14 +97,121 @@ public:
         fCurrentState.fEnableBlend = enabled;
     }
 
+    // If disabled, pixels are depth tested and counted by occlusion queries,
+    // but not written to the color buffer. This is useful to draw a
+    // simple proxy for an object to find out whether it is visible.
+    void enableColorWrite(bool enabled)
+    {
+        fCurrentState.fEnableColorWrite = enabled;
+    }
+
+    // If disabled, pixels are depth tested against the depth buffer, but
+    // don't update it.
+    void enableDepthWrite(bool enabled)
+    {
+        fCurrentState.fEnableDepthWrite = enabled;
+    }
+
+    // Draw calls after this count the pixels that pass the depth test in
+    // query, until endQuery is called. The result is available after the
+    // frame is finished.
+    void beginQuery(OcclusionQuery *query)
+    {
+        fCurrentState.fOcclusionQuery = query;
+    }
+
+    void endQuery()
+    {
+        fCurrentState.fOcclusionQuery = nullptr;
+    }
+
     // Draw primitives using currently configured state set by bindXXX calls.
     // Indices reference into bound vertex attribute buffer.
     void drawElements(const RenderBuffer *indices);
 
+    // Same as above, but first tests an object space bounding box of the
+    // vertices against the view frustum, and skips the draw call without
+    // shading any vertices if the box is completely outside it.
+    // mvpMatrix transforms object space to clip space. This is normally the
+    // same matrix the vertex shader uses, which librender can't get from
+    // the uniforms. Returns false if the draw call was culled.
+    // While a command buffer is being recorded, the test is deferred until
+    // the buffer is executed (see executeCommandBuffer).
+    bool drawElements(const RenderBuffer *indices, const Vec3 &boundsMin,
+                      const Vec3 &boundsMax, const Matrix &mvpMatrix);
+
+    // Draw instanceCount copies of the primitives. Element i of
+    // instanceAttrs holds the attributes for instance i, which are passed
+    // to Shader::shadeVertices after the vertex attributes. instanceAttrs
+    // may be null if the shader has no instance attributes. Vertices of all
+    // instances are shaded together, so meshes with fewer than 16 vertices
+    // still fill the vector lanes. Triangles are drawn in instance order.
+    void drawElementsInstanced(const RenderBuffer *indices, int instanceCount,
+                               const RenderBuffer *instanceAttrs);
+
+    // Same as drawElements, but skips the draw call if query has a result
+    // and no pixels passed the depth test in it. Because the result comes
+    // from a previous frame, an object that becomes visible appears a
+    // frame late. Returns false if the draw call was skipped. While a
+    // command buffer is being recorded, the query is checked each time
+    // the buffer is executed.
+    bool drawElementsConditional(const RenderBuffer *indices, const OcclusionQuery *query);
+
+    // Same as above, but also tests a bounding box against the view frustum
+    // like drawElements.
+    bool drawElementsConditional(const RenderBuffer *indices, const OcclusionQuery *query,
+                                 const Vec3 &boundsMin, const Vec3 &boundsMax,
+                                 const Matrix &mvpMatrix);
+
+    // Record draw calls into a command buffer instead of the current frame,
+    // until endCommandBuffer is called. This discards anything previously
+    // recorded in the buffer. State bound before this call, including
+    // uniforms, carries over into the recording.
+    void beginCommandBuffer(CommandBuffer *buffer);
+    void endCommandBuffer();
+
+    // Append the draw calls recorded in a command buffer to the current
+    // frame. This doesn't copy their state, so it is much cheaper than
+    // issuing them again. If cullMatrix is not null, draw calls that were
+    // recorded with a bounding box are tested against the view frustum
+    // again, using cullMatrix multiplied by the matrix they were recorded
+    // with. This doesn't change the currently bound state.
+    void executeCommandBuffer(const CommandBuffer *buffer, const Matrix *cullMatrix = nullptr);
+
     // Execute all submitted drawing commands. No rendering occurs until
     // this is called.
     void finish();
 
+    // Pipelined alternative to finish(). This runs the geometry phase for
+    // the drawing commands submitted since the last call, but leaves the
+    // pixel phase pending. The pixel phase runs on threads that would
+    // otherwise be idle during the geometry phase of the next submit(),
+    // or when waitFrame() is called. The application may record the next
+    // frame immediately, but must not modify buffers or surfaces the
+    // previous frame uses until waitFrame() returns. This uses a second
+    // working memory region of the same size as the first.
+    void submit();
+
+    // Finish rendering the last frame passed to submit(). Does nothing if
+    // there is no frame pending.
+    void waitFrame();
+
+    // The most working memory any frame has used, in bytes. If this is
+    // larger than the size passed to the constructor, the working memory
+    // overflowed and was grown, and the constructor should be passed at
+    // least this much.
+    size_t getWorkingMemHighWaterMark() const;
+
+    // Collect fill and flush cycles and cache misses in the frame stats.
+    // This uses hardware performance counters 0 and 1.
+    void enableProfiling(bool enable);
+
+    // Stats for the last frame whose pixel phase finished.
+    const FrameStats &getFrameStats() const
+    {
+        return fFrameStats;
+    }
+
     // If this is set, no pixels will be rendered, but lines will be drawn at the
     // edge of rendered triangles.
     void enableWireframeMode(bool enable)
@@ -109,53 +224,230 @@ public:
         fCurrentState.cullingMode = mode;
     }
 
+    // If enabled, draw calls after this only run the vertex shader on
+    // vertices that the index buffer references, and each vertex is
+    // shaded once even if many triangles share it. This is faster when
+    // draw calls use a small part of a large vertex buffer.
+    void enableIndexedVertexShading(bool enabled)
+    {
+        fCurrentState.fIndexedVertexShading = enabled;
+    }
+
 private:
+    // A set up triangle. Each is stored once, in its own cache line, so
+    // filling it only reads one line of setup data besides its parameters.
+    // Raster coordinates are recomputed from the screen coordinates with
+    // getRasterX/getRasterY rather than stored, to keep it within the line.
     struct Triangle
     {
-        int sequenceNumber;
-        const RenderState *state;
         float x0, y0, z0, x1, y1, z1, x2, y2, z2;
-        int x0Rast, y0Rast, x1Rast, y1Rast, x2Rast, y2Rast;
+        float nearestZ;
+        const RenderState *state;
         const float *params;
         bool woundCCW;
-        bool operator>(const Triangle &tri) const
+        char padding[kCacheLineSize - sizeof(float) * 10 - sizeof(void*) * 2 - sizeof(bool)];
+    };
+
+    static_assert(sizeof(Triangle) == kCacheLineSize, "Triangle must fill one cache line");
+
+    // Tile bins only contain a reference to the triangle.
+    struct BinEntry
+    {
+        int sequenceNumber;
+        const Triangle *triangle;
+    };
+
+    // Each tile has a separate triangle bin for each hardware thread. A thread
+    // sets up triangles in increasing sequence order, so each bin is sorted
+    // and needs no synchronization.
+    typedef CommandQueue<BinEntry, 64> TriangleArray;
+
+    // A draw call in the current frame. The render state is either
+    // allocated with the frame or owned by a command buffer, so buffers
+    // the geometry phase fills are kept here rather than in it.
+    struct DrawCommand
+    {
+        const RenderState *state;
+        float *vertexParams;
+    };
+
+    // For draws with indexed vertex shading, maps a vertex index to its
+    // location in vertexParams. The table is kept across draws and frames.
+    // An entry only belongs to the current draw if its generation matches
+    // fVertexSlotGeneration, so a draw doesn't need to clear an entry for
+    // every vertex in the buffer.
+    struct VertexSlot
+    {
+        int generation;
+        int slot;
+    };
+
+    typedef CommandQueue<DrawCommand, 32> DrawQueue;
+
+    // Convert screen space coordinates to raster coordinates.
+    static int getRasterX(float x, int halfWidth)
+    {
+        return x * halfWidth + halfWidth;
+    }
+
+    static int getRasterY(float y, int halfHeight)
+    {
+        return -y * halfHeight + halfHeight;
+    }
+
+    Triangle *allocateTriangle(int threadId);
+
+    // Occlusion queries used in a frame, which are resolved when its pixel
+    // phase finishes.
+    struct QueryLink
+    {
+        OcclusionQuery *query;
+        QueryLink *next;
+    };
+
+    // Counters that each thread updates during a frame, so they don't need
+    // atomic operations. These are padded to the size of a cache line to
+    // limit false sharing.
+    struct ThreadStats
+    {
+        // Geometry phase
+        int frustumCulledTriangles;
+        int backfaceCulledTriangles;
+        int binnedTriangles;
+
+        // Pixel phase
+        int occludedTriangles;
+        unsigned int fillCycles;
+        unsigned int flushCycles;
+        char padding[kCacheLineSize - sizeof(int) * 6];
+    };
+
+    // State the pixel phase needs. This is captured when the geometry phase
+    // finishes, so drawing commands for the next frame can be recorded
+    // while this one renders.
+    struct PixelFrame
+    {
+        RegionAllocator *allocator = nullptr;
+        TriangleArray *tiles = nullptr;
+        RenderTarget target;
+        int fbWidth = 0;
+        int fbHeight = 0;
+        int tileColumns = 0;
+        int numTiles = 0;
+        int nextTile = 0;	// Tiles before this have been dispatched
+
+        // Tile indices in the order they are dispatched, heaviest first.
+        int *tileOrder = nullptr;
+        int *tileTriangleCounts = nullptr;	// Summed over all threads
+        FrameStats stats;
+        bool profiling = false;
+        unsigned int startL2Misses = 0;
+        unsigned int startDCacheMisses = 0;
+        bool clearColorBuffer = false;
+        unsigned int clearColor = 0;
+        bool wireframeMode = false;
+        QueryLink *queries = nullptr;
+
+        TriangleArray *getTileBins(int tileIndex) const
+        {
+            return tiles + tileIndex * kMaxThreads;
+        }
+
+        bool isTileEmpty(int tileIndex) const
         {
-            return sequenceNumber > tri.sequenceNumber;
+            const TriangleArray *bins = getTileBins(tileIndex);
+            for (int i = 0; i < kMaxThreads; i++)
+            {
+                if (!bins[i].empty())
+                    return false;
+            }
+
+            return true;
         }
     };
 
+    void appendDraw(const RenderState *state);
+    void runGeometryPhase();
+    void runGeometryStep(parallel_range_func_t func, int numItems, parallel_schedule schedule,
+                         int chunkSize, int stepsRemaining);
+    void beginPixelPhase();
+    void orderTilesByCost();
+    void resolveFrameStats();
+    void pixelJob(int index);
     void shadeVertices(int index);
+    void beginVertexSlotGeneration(int numVertices);
+    void shadeIndexedVertices(int index);
     void setUpTriangle(int triangleIndex);
     void fillTile(int index);
     void wireframeTile(int index);
-    static void _shadeVertices(void *_castToContext, int index);
-    static void _setUpTriangle(void *_castToContext, int index);
-    static void _fillTile(void *_castToContext, int index);
-    static void _wireframeTile(void *_castToContext, int index);
+    static void _pipelinedJob(void *_castToContext, int index);
+    static void _shadeVertices(void *_castToContext, int begin, int end);
+    static void _shadeIndexedVertices(void *_castToContext, int begin, int end);
+    static void _setUpTriangles(void *_castToContext, int begin, int end);
     void clipOne(int sequence, const RenderState &command, const float *params0, const float *params1,
                  const float *params2);
     void clipTwo(int sequence, const RenderState &command, const float *params0, const float *params1,
                  const float *params2);
+    void clipPolygon(int sequence, const RenderState &command, const float *params0,
+                     const float *params1, const float *params2, int clipPlanes);
     void enqueueTriangle(int sequence, const RenderState &command, const float *params0,
                          const float *params1, const float *params2);
 
-    typedef CommandQueue<Triangle, 64> TriangleArray;
-    typedef CommandQueue<RenderState, 32> DrawQueue;
+    TriangleArray *getTileBins(int tileIndex) const
+    {
+        return fTiles + tileIndex * kMaxThreads;
+    }
+
+    void binTriangle(int tileIndex, int threadId, const BinEntry &entry)
+    {
+        getTileBins(tileIndex)[threadId].appendUnsynchronized(entry);
+        fTileTriangleCounts[threadId * fTileColumns * fTileRows + tileIndex]++;
+    }
 
     bool fClearColorBuffer;
     RenderTarget *fRenderTarget = nullptr;
     TriangleArray *fTiles = nullptr;
+
+    // Number of triangles each thread has binned in each tile. Each thread
+    // has its own array of counts, so this doesn't need atomic operations.
+    int *fTileTriangleCounts = nullptr;
+    Triangle *fCurrentTriangleBlock[kMaxThreads];
+    int fNextTriangleSlot[kMaxThreads];
     int fFbWidth = 0;
     int fFbHeight = 0;
     int fTileColumns = 0;
     int fTileRows = 0;
-    RegionAllocator fAllocator;
+    unsigned int fWorkingMemSize;
+    RegionAllocator fDefaultAllocator;
+    RegionAllocator *fAlternateAllocator = nullptr;
+
+    // Drawing commands and geometry phase output are allocated from here.
+    RegionAllocator *fAllocator;
     RenderState fCurrentState;
+    CommandBuffer *fRecordingBuffer = nullptr;
     DrawQueue fDrawQueue;
     DrawQueue::iterator fRenderCommandIterator = fDrawQueue.end();
+    QueryLink *fFrameQueries = nullptr;
+    int fFrameNumber = 0;
     int fBaseSequenceNumber = 0;
+    int fNumShadedVertices = 0;
+    VertexSlot *fVertexSlots = nullptr;
+    int fVertexSlotTableSize = 0;
+    int fVertexSlotGeneration = 0;
     unsigned int fClearColor = 0xff000000;
     bool fWireframeMode = false;
+    PixelFrame fPixelFrame;
+    bool fPixelFramePending = false;
+    parallel_range_func_t fGeometryFunc = nullptr;
+    int fGeometryChunkSize = 1;
+    int fNumGeometryItems = 0;
+    int fNumGeometryJobs = 0;
+    ThreadStats fThreadStats[kMaxThreads];
+    FrameStats fRecordingStats;	// Frame that draw calls are being submitted to
+    FrameStats fFrameStats;
+    int *fStatsTileCounts = nullptr;
+    int fNumStatsTiles = 0;
+    bool fProfiling = false;
 };
 
 } // namespace librender
@@ -25,15 +25,27 @@ namespace librender
 
 const int kMaxActiveTextures = 4;
 
+class OcclusionQuery;
+class TriangleFiller;
+
+// Fills one 4x4 block of a triangle. These are instantiations of
+// TriangleFiller::fillBlock specialized for a draw call.
+typedef void (*FillFunction)(TriangleFiller &filler, int left, int top, vmask_t mask);
+
 struct RenderState
 {
     bool fEnableDepthBuffer = false;
     bool fEnableBlend = false;
+    bool fEnableColorWrite = true;
+    bool fEnableDepthWrite = true;
     const RenderBuffer *fVertexAttrBuffer = nullptr;
     const RenderBuffer *fIndexBuffer = nullptr;
+    const RenderBuffer *fInstanceAttrBuffer = nullptr;
+    int fNumInstances = 1;
     const void *fUniforms = nullptr;
+    size_t fUniformSize = 0;
     int fParamsPerVertex = 0;
-    float *fVertexParams = nullptr;
+    bool fIndexedVertexShading = false;
     const class Shader *fShader = nullptr;
     const Texture *fTextures[kMaxActiveTextures];
     enum CullingMode
@@ -42,6 +54,13 @@ struct RenderState
         kCullCCW,
         kCullNone
     } cullingMode = kCullCW;
+
+    // If set, pixels that pass the depth test are counted in this query.
+    OcclusionQuery *fOcclusionQuery = nullptr;
+
+    // Selected when the draw call is submitted. Indexed by whether the
+    // triangle needs perspective correct interpolation.
+    FillFunction fFillFunctions[2] = { nullptr, nullptr };
 };
 
 } // namespace librender
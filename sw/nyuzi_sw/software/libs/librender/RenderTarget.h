@@ -24,7 +24,9 @@ namespace librender
 {
 
 //
-// A set of surfaces to render to.
+// A set of surfaces to render to. The color buffer may be omitted to render
+// only depth, for example into a shadow map, in which case pixels are not
+// shaded. The depth buffer may then be sampled as a texture.
 //
 class RenderTarget
 {
@@ -49,6 +51,13 @@ public:
         return fDepthBuffer;
     }
 
+    // The surface that determines the size of the target: the color buffer,
+    // or the depth buffer for depth-only targets.
+    Surface *getPrimarySurface() const
+    {
+        return fColorBuffer ? fColorBuffer : fDepthBuffer;
+    }
+
 private:
     Surface *fColorBuffer = nullptr;
     Surface *fDepthBuffer = nullptr;
@@ -54,6 +54,9 @@ public:
 
     // This is called on batches of up to 16 vertices. Attributes come in, read in
     // from RenderBuffers, and parameters are returned into outParams.
+    // For instanced draw calls, a batch may contain vertices from several
+    // instances. inAttribs holds the vertex attributes, followed by the
+    // attributes of the instance each vertex belongs to.
     virtual void shadeVertices(vecf16_t *outParams, const vecf16_t *inAttribs,
                                const void *uniforms, vmask_t mask) const = 0;
 
@@ -65,6 +68,14 @@ public:
                              const void *uniforms, const Texture * const * sampler,
                              vmask_t mask) const = 0;
 
+    // Returns a fill function specialized for this shader and the draw
+    // state, or nullptr to use the generic one. SpecializedShader implements
+    // this.
+    virtual FillFunction getFillFunction(const RenderState &, bool) const
+    {
+        return nullptr;
+    }
+
     // Number of parameters that shadeVertices returns for each vertex.
     int getNumParams() const
     {
@@ -77,15 +88,24 @@ public:
         return fAttribsPerVertex;
     }
 
+    // Number of per-instance attributes passed to shadeVertices after the
+    // vertex attributes.
+    int getNumInstanceAttribs() const
+    {
+        return fInstanceAttribs;
+    }
+
 protected:
-    Shader(int attribsPerVertex, int paramsPerVertex)
+    Shader(int attribsPerVertex, int paramsPerVertex, int instanceAttribs = 0)
         : fParamsPerVertex(paramsPerVertex),
-          fAttribsPerVertex(attribsPerVertex)
+          fAttribsPerVertex(attribsPerVertex),
+          fInstanceAttribs(instanceAttribs)
     {}
 
 private:
     int fParamsPerVertex;
     int fAttribsPerVertex;
+    int fInstanceAttribs;
 };
 
 } // namespace librender
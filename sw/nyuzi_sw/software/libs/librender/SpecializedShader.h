@@ -0,0 +1,57 @@
+//
+// Copyright 2011-2015 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#pragma once
+
+#include "Shader.h"
+#include "TriangleFiller.h"
+
+namespace librender
+{
+
+//
+// Base class for shaders that want a fill pipeline compiled for them.
+// Derived is the shader class itself, which must implement shadePixels.
+// The attribute and parameter counts are compile time constants, so the
+// filler can unroll parameter interpolation and call shadePixels directly,
+// without a virtual call. kInstanceAttribs is the number of per-instance
+// attributes for instanced draw calls.
+//
+//   class MyShader : public SpecializedShader<MyShader, 3, 6>
+//
+
+template <typename Derived, int kAttribsPerVertex, int kParamsPerVertex,
+          int kInstanceAttribs = 0>
+class SpecializedShader : public Shader
+{
+public:
+    static_assert(kParamsPerVertex >= 4 && kParamsPerVertex - 4 <= kMaxParams,
+                  "Invalid parameter count");
+
+    FillFunction getFillFunction(const RenderState &state, bool perspective) const override
+    {
+        return TriangleFiller::selectFillFunction<Derived, kParamsPerVertex - 4>(state,
+                perspective);
+    }
+
+protected:
+    SpecializedShader()
+        : Shader(kAttribsPerVertex, kParamsPerVertex, kInstanceAttribs)
+    {}
+};
+
+} // namespace librender
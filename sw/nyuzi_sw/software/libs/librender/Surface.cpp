@@ -15,38 +15,138 @@
 //
 
 
+#include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include "Shader.h"
 #include "Surface.h"
 
 namespace librender
 {
 
-Surface::Surface(int width, int height, void *base)
+namespace
+{
+
+const float kOneOver255 = 1.0 / 255.0;
+
+} // namespace
+
+Surface::Surface(int width, int height, void *base, Layout layout, Format format)
     : fWidth(width),
       fHeight(height),
-      fStride(width * kBytesPerPixel),
+      fStride(getRowStride(width, format)),
+      fBytesPerPixel(getBytesPerPixel(format)),
       fBaseAddress(reinterpret_cast<int>(base)),
-      fOwnedPointer(false)
+      fOwnedPointer(false),
+      fLayout(layout),
+      fFormat(format),
+      fTileShift(getTileShift(width, height, layout)),
+      fTileColumns((width + (1 << fTileShift) - 1) >> fTileShift)
 {
     initializeOffsetVectors();
+    initializeTileStates();
 }
 
-Surface::Surface(int width, int height)
+Surface::Surface(int width, int height, Layout layout, Format format)
     : fWidth(width),
       fHeight(height),
-      fStride(width * kBytesPerPixel),
-      fOwnedPointer(true)
+      fStride(getRowStride(width, format)),
+      fBytesPerPixel(getBytesPerPixel(format)),
+      fOwnedPointer(true),
+      fLayout(layout),
+      fFormat(format),
+      fTileShift(getTileShift(width, height, layout)),
+      fTileColumns((width + (1 << fTileShift) - 1) >> fTileShift)
 {
     fBaseAddress = reinterpret_cast<int>(memalign(kCacheLineSize,
-                                         static_cast<size_t>(width * height * kBytesPerPixel)));
+                                         static_cast<size_t>(getAllocationSize(width, height,
+                                                 layout, format))));
     initializeOffsetVectors();
+    initializeTileStates();
 }
 
 Surface::~Surface()
 {
     if (fOwnedPointer)
         ::free(reinterpret_cast<void*>(fBaseAddress));
+
+    delete[] fTileStates;
+}
+
+void Surface::initializeTileStates()
+{
+    fTileStateColumns = (fWidth + kTileSize - 1) / kTileSize;
+    int tileStateRows = (fHeight + kTileSize - 1) / kTileSize;
+    fTileStates = new TileState[fTileStateColumns * tileStateRows];
+}
+
+int Surface::getAllocationSize(int width, int height, Layout layout, Format format)
+{
+    if (format == kBC1)
+    {
+        assert(layout == kLinear && (width & 3) == 0 && (height & 3) == 0);
+        return (width / 4) * (height / 4) * kBC1BlockSize;
+    }
+
+    int bytesPerPixel = getBytesPerPixel(format);
+    if (layout == kLinear)
+        return getRowStride(width, format) * height;
+
+    int tileShift = getTileShift(width, height, layout);
+    int tileMask = (1 << tileShift) - 1;
+    int tileColumns = (width + tileMask) >> tileShift;
+    int tileRows = (height + tileMask) >> tileShift;
+    return (tileColumns * tileRows * bytesPerPixel) << (tileShift * 2);
+}
+
+int Surface::getRowStride(int width, Format format)
+{
+    // Narrow pixels are written with a read-modify-write of the word that
+    // contains them. Padding rows to a whole number of words keeps the edges
+    // of render tiles on word boundaries, so threads filling neighboring
+    // tiles never write the same word.
+    return (width * getBytesPerPixel(format) + 3) & ~3;
+}
+
+int Surface::getBytesPerPixel(Format format)
+{
+    switch (format)
+    {
+        case kRGBA8888:
+        case kD32F:
+            return 4;
+
+        case kRGB565:
+        case kR16:
+        case kD16:
+            return 2;
+
+        case kR8:
+            return 1;
+
+        case kBC1:
+            break;
+    }
+
+    return 0;
+}
+
+//
+// Tiles are kTileSize pixels on a side, or the largest power of two that
+// fits in the surface if it is smaller. They are never smaller than a
+// 4x4 block.
+//
+int Surface::getTileShift(int width, int height, Layout layout)
+{
+    int tileShift = __builtin_ctz(kTileSize);
+    if (layout == kTiled)
+    {
+        assert((width & 3) == 0 && (height & 3) == 0);
+        while (tileShift > 2 && ((1 << tileShift) > width || (1 << tileShift) > height))
+            tileShift--;
+    }
+
+    return tileShift;
 }
 
 void Surface::initializeOffsetVectors()
@@ -76,58 +176,379 @@ void Surface::initializeOffsetVectors()
 
     f4x4AtOrigin =
     {
-        0, 4, 8, 12,
-        0, 4, 8, 12,
-        0, 4, 8, 12,
-        0, 4, 8, 12
+        0, 1, 2, 3,
+        0, 1, 2, 3,
+        0, 1, 2, 3,
+        0, 1, 2, 3
     };
 
-    veci16_t widthOffset =
+    veci16_t rowOffset =
     {
         0, 0, 0, 0,
-        4, 4, 4, 4,
-        8, 8, 8, 8,
-        12, 12, 12, 12
+        1, 1, 1, 1,
+        2, 2, 2, 2,
+        3, 3, 3, 3
+    };
+
+    f4x4AtOrigin = f4x4AtOrigin * fBytesPerPixel + rowOffset * fStride + fBaseAddress;
+
+    fTiledBlockOffsets =
+    {
+        0, 1, 2, 3,
+        4, 5, 6, 7,
+        8, 9, 10, 11,
+        12, 13, 14, 15
     };
 
-    f4x4AtOrigin += widthOffset * fWidth + fBaseAddress;
+    fTiledBlockOffsets = fTiledBlockOffsets * fBytesPerPixel + fBaseAddress;
+}
+
+//
+// Pixels smaller than a word are read by gathering the words that contain
+// them and shifting each into place.
+//
+vecu16_t Surface::readNarrowPixels(veci16_t pointers, vmask_t mask) const
+{
+    vecu16_t pixelMask = (1u << (fBytesPerPixel * 8)) - 1;
+    vecu16_t shift = vecu16_t((pointers & 3) << 3);
+    vecu16_t words = __builtin_nyuzi_gather_loadi_masked(pointers & ~3, mask);
+    return (words >> shift) & pixelMask;
+}
+
+//
+// Writing pixels smaller than a word is a read-modify-write of the words that
+// contain them. Lanes that share a word would overwrite each other's results,
+// so this does one pass for each pixel position within a word. The lanes in a
+// pass all have different words. Rows are padded to a whole number of words
+// (see getRowStride), so tile edges are on word boundaries and threads
+// filling different tiles never write the same word.
+//
+void Surface::writeNarrowPixels(veci16_t pointers, vecu16_t values, vmask_t mask)
+{
+    unsigned int pixelMask = (1u << (fBytesPerPixel * 8)) - 1;
+    veci16_t wordPointers = pointers & ~3;
+    veci16_t byteOffset = pointers & 3;
+    for (int offset = 0; offset < 4; offset += fBytesPerPixel)
+    {
+        vmask_t passMask = mask & __builtin_nyuzi_mask_cmpi_eq(byteOffset, veci16_t(offset));
+        if (passMask == 0)
+            continue;
+
+        int shift = offset * 8;
+        vecu16_t words = __builtin_nyuzi_gather_loadi_masked(wordPointers, passMask);
+        words = (words & ~(pixelMask << shift)) | ((values & pixelMask) << shift);
+        __builtin_nyuzi_scatter_storei_masked(wordPointers, words, passMask);
+    }
+}
+
+void Surface::unpackPixels(vecu16_t values, vecf16_t *outColor) const
+{
+    switch (fFormat)
+    {
+        case kRGBA8888:
+            outColor[kColorR] = __builtin_convertvector(values & 255, vecf16_t) * kOneOver255;
+            outColor[kColorG] = __builtin_convertvector((values >> 8) & 255, vecf16_t)
+                                * kOneOver255;
+            outColor[kColorB] = __builtin_convertvector((values >> 16) & 255, vecf16_t)
+                                * kOneOver255;
+            outColor[kColorA] = __builtin_convertvector(values >> 24, vecf16_t) * kOneOver255;
+            break;
+
+        case kRGB565:
+            outColor[kColorR] = __builtin_convertvector((values >> 11) & 31, vecf16_t)
+                                * (1.0f / 31.0f);
+            outColor[kColorG] = __builtin_convertvector((values >> 5) & 63, vecf16_t)
+                                * (1.0f / 63.0f);
+            outColor[kColorB] = __builtin_convertvector(values & 31, vecf16_t)
+                                * (1.0f / 31.0f);
+            outColor[kColorA] = 1.0f;
+            break;
+
+        case kR8:
+        case kR16:
+            outColor[kColorR] = __builtin_convertvector(values, vecf16_t)
+                                * (1.0f / ((1 << (fBytesPerPixel * 8)) - 1));
+            outColor[kColorG] = 0.0f;
+            outColor[kColorB] = 0.0f;
+            outColor[kColorA] = 1.0f;
+            break;
+
+        case kD16:
+        case kD32F:
+            // For kD32F, the cast does not perform an int/float conversion.
+            outColor[kColorR] = fFormat == kD16 ? unpackD16(values) : vecf16_t(values);
+            outColor[kColorG] = outColor[kColorR];
+            outColor[kColorB] = outColor[kColorR];
+            outColor[kColorA] = 1.0f;
+            break;
+
+        case kBC1:
+            assert(0);
+    }
 }
 
+vecu16_t Surface::packPixels(const vecf16_t *color) const
+{
+    vecu16_t channels[4];
+    switch (fFormat)
+    {
+        case kRGBA8888:
+            for (int i = 0; i < 4; i++)
+            {
+                channels[i] = __builtin_convertvector(clamp(color[i], 0.0f, 1.0f) * 255.0f,
+                                                      vecu16_t);
+            }
+
+            return channels[kColorR] | (channels[kColorG] << 8) | (channels[kColorB] << 16)
+                   | (channels[kColorA] << 24);
+
+        case kRGB565:
+            channels[kColorR] = __builtin_convertvector(clamp(color[kColorR], 0.0f, 1.0f)
+                                * 31.0f, vecu16_t);
+            channels[kColorG] = __builtin_convertvector(clamp(color[kColorG], 0.0f, 1.0f)
+                                * 63.0f, vecu16_t);
+            channels[kColorB] = __builtin_convertvector(clamp(color[kColorB], 0.0f, 1.0f)
+                                * 31.0f, vecu16_t);
+            return (channels[kColorR] << 11) | (channels[kColorG] << 5) | channels[kColorB];
+
+        case kR8:
+        case kR16:
+            return __builtin_convertvector(clamp(color[kColorR], 0.0f, 1.0f)
+                                           * float((1 << (fBytesPerPixel * 8)) - 1), vecu16_t);
+
+        case kD16:
+            return packD16(color[kColorR]);
+
+        case kD32F:
+            return vecu16_t(color[kColorR]);
+
+        case kBC1:
+            assert(0);
+    }
+
+    return 0;
+}
+
+unsigned int Surface::replicatePixel(unsigned int value) const
+{
+    // Replicate the pixel value to fill a word
+    if (fBytesPerPixel == 1)
+        return (value & 0xff) * 0x01010101;
+    else if (fBytesPerPixel == 2)
+        return (value & 0xffff) * 0x00010001;
+
+    return value;
+}
+
+void Surface::clearTileMemory(int left, int top, unsigned int value)
+{
+    value = replicatePixel(value);
+    if (fLayout == kTiled)
+        clearTileTiled(left, top, value);
+    else if (kTileSize == 64 && fWidth - left >= 64 && fHeight - top >= 64
+             && (fStride & (kCacheLineSize - 1)) == 0)
+    {
+        // Fast clear using block stores. Each row of the tile is
+        // fBytesPerPixel cache lines.
+        vecu16_t vval = value;
+        vecu16_t *ptr = reinterpret_cast<vecu16_t*>(fBaseAddress + left * fBytesPerPixel
+                        + top * fStride);
+        const int kStride = fStride / kCacheLineSize;
+        for (int y = 0; y < 64; y++)
+        {
+            for (int i = 0; i < fBytesPerPixel; i++)
+                ptr[i] = vval;
+
+            ptr += kStride;
+        }
+    }
+    else
+        clearTileSlow(left, top, value);
+}
+
+void Surface::resolveTile(int left, int top)
+{
+    TileState &state = fTileStates[tileStateIndex(left, top)];
+    if (!state.pendingClear)
+        return;
+
+    clearTileMemory(left, top, state.clearValue);
+    state.pendingClear = false;
+    state.memoryCleared = true;
+    state.dirty = true;
+}
+
+void Surface::flushDirtyTile(int left, int top)
+{
+    TileState &state = fTileStates[tileStateIndex(left, top)];
+    if (state.pendingClear)
+    {
+        streamClearTile(left, top, state.clearValue);
+        state.pendingClear = false;
+        state.memoryCleared = true;
+    }
+    else if (state.dirty)
+        flushTile(left, top);
+
+    state.dirty = false;
+}
+
+//
+// Nyuzi doesn't have non-temporal stores. Flushing each cache line right
+// after filling it with a block store is the closest equivalent: lines go
+// out to memory in order instead of filling the L2 cache and then being
+// written back by a separate walk over the tile.
+//
+void Surface::streamClearTile(int left, int top, unsigned int value)
+{
+    const vecu16_t kClearColor = vecu16_t(replicatePixel(value));
+    if (fLayout == kTiled)
+    {
+        int tileWidth = 1 << fTileShift;
+        int tileBytes = fBytesPerPixel << (fTileShift * 2);
+        if ((tileBytes & (kCacheLineSize - 1)) == 0)
+        {
+            int right = min(left + kTileSize, fWidth);
+            int bottom = min(top + kTileSize, fHeight);
+            for (int y = top; y < bottom; y += tileWidth)
+            {
+                for (int x = left; x < right; x += tileWidth)
+                {
+                    int ptr = fBaseAddress + tiledOffset(x, y);
+                    for (int offset = 0; offset < tileBytes; offset += kCacheLineSize)
+                    {
+                        *reinterpret_cast<vecu16_t*>(ptr + offset) = kClearColor;
+                        asm("dflush %0" : : "s" (ptr + offset));
+                    }
+                }
+            }
+
+            return;
+        }
+    }
+    else
+    {
+        int rowAddress = fBaseAddress + left * fBytesPerPixel + top * fStride;
+        int rowBytes = min(kTileSize, fWidth - left) * fBytesPerPixel;
+        if (((rowAddress | rowBytes | fStride) & (kCacheLineSize - 1)) == 0)
+        {
+            int bottom = min(kTileSize, fHeight - top);
+            for (int y = 0; y < bottom; y++)
+            {
+                for (int offset = 0; offset < rowBytes; offset += kCacheLineSize)
+                {
+                    *reinterpret_cast<vecu16_t*>(rowAddress + offset) = kClearColor;
+                    asm("dflush %0" : : "s" (rowAddress + offset));
+                }
+
+                rowAddress += fStride;
+            }
+
+            return;
+        }
+    }
+
+    // Tiles that don't cover whole cache lines
+    clearTileMemory(left, top, value);
+    flushTile(left, top);
+}
+
+//
+// Clear a tile of a linear surface that is not aligned or extends past the
+// edge. value has already been replicated to fill a word.
+//
 void Surface::clearTileSlow(int left, int top, unsigned int value)
 {
-    veci16_t *ptr = reinterpret_cast<veci16_t*>(fBaseAddress + (left + top * fWidth)
-                    * kBytesPerPixel);
-    const veci16_t kClearColor = veci16_t(value);
     int right = min(kTileSize, fWidth - left);
     int bottom = min(kTileSize, fHeight - top);
-    const int kStride = ((fWidth - right) * kBytesPerPixel / kVectorSize);
+    int rowBytes = right * fBytesPerPixel;
+    int rowAddress = fBaseAddress + left * fBytesPerPixel + top * fStride;
+    const veci16_t kClearColor = veci16_t(value);
 
     for (int y = 0; y < bottom; y++)
     {
-        // XXX LLVM ends up turning this into memset
-        for (int x = 0; x < right; x += 16)
-            *ptr++ = kClearColor;
+        if ((rowAddress & (kVectorSize - 1)) == 0 && (rowBytes & (kVectorSize - 1)) == 0)
+        {
+            // XXX LLVM ends up turning this into memset
+            veci16_t *ptr = reinterpret_cast<veci16_t*>(rowAddress);
+            for (int offset = 0; offset < rowBytes; offset += kVectorSize)
+                *ptr++ = kClearColor;
+        }
+        else
+        {
+            unsigned int *ptr = reinterpret_cast<unsigned int*>(rowAddress);
+            for (int offset = 0; offset < rowBytes; offset += 4)
+                *ptr++ = value;
+        }
 
-        ptr += kStride;
+        rowAddress += fStride;
+    }
+}
+
+//
+// Each kTileSize render tile covers one or more whole surface tiles, which
+// are contiguous.
+//
+void Surface::clearTileTiled(int left, int top, unsigned int value)
+{
+    const vecu16_t kClearColor = vecu16_t(value);
+    int tileWidth = 1 << fTileShift;
+    int tileBytes = fBytesPerPixel << (fTileShift * 2);
+    int right = min(left + kTileSize, fWidth);
+    int bottom = min(top + kTileSize, fHeight);
+    for (int y = top; y < bottom; y += tileWidth)
+    {
+        for (int x = left; x < right; x += tileWidth)
+        {
+            int tileAddress = fBaseAddress + tiledOffset(x, y);
+            if ((tileBytes & (kVectorSize - 1)) == 0)
+            {
+                vecu16_t *ptr = reinterpret_cast<vecu16_t*>(tileAddress);
+                for (int i = 0; i < tileBytes / kVectorSize; i++)
+                    ptr[i] = kClearColor;
+            }
+            else
+            {
+                // Small tiles of small pixels don't fill a vector
+                unsigned int *ptr = reinterpret_cast<unsigned int*>(tileAddress);
+                for (int i = 0; i < tileBytes / 4; i++)
+                    ptr[i] = value;
+            }
+        }
     }
 }
 
 // Push a NxN tile from the L2 cache back to system memory
 void Surface::flushTile(int left, int top)
 {
-    int ptr = fBaseAddress + (left + top * fWidth) * kBytesPerPixel;
-    int right = min(kTileSize, fWidth - left);
-    int bottom = min(kTileSize, fHeight - top);
-    const int kStride = (fWidth - right) * kBytesPerPixel;
-    for (int y = 0; y < bottom; y++)
+    if (fLayout == kTiled)
     {
-        for (int x = 0; x < right; x += 16)
+        int tileWidth = 1 << fTileShift;
+        int tileBytes = fBytesPerPixel << (fTileShift * 2);
+        int right = min(left + kTileSize, fWidth);
+        int bottom = min(top + kTileSize, fHeight);
+        for (int y = top; y < bottom; y += tileWidth)
         {
-            asm("dflush %0" : : "s" (ptr));
-            ptr += kCacheLineSize;
+            for (int x = left; x < right; x += tileWidth)
+            {
+                int ptr = fBaseAddress + tiledOffset(x, y);
+                for (int offset = 0; offset < tileBytes; offset += kCacheLineSize)
+                    asm("dflush %0" : : "s" (ptr + offset));
+            }
         }
 
-        ptr += kStride;
+        return;
+    }
+
+    int rowAddress = fBaseAddress + left * fBytesPerPixel + top * fStride;
+    int rowBytes = min(kTileSize, fWidth - left) * fBytesPerPixel;
+    int bottom = min(kTileSize, fHeight - top);
+    for (int y = 0; y < bottom; y++)
+    {
+        for (int offset = 0; offset < rowBytes; offset += kCacheLineSize)
+            asm("dflush %0" : : "s" (rowAddress + offset));
+
+        rowAddress += fStride;
     }
 }
 
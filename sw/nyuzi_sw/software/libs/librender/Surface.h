@@ -20,34 +20,89 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "Constants.h"
 #include "SIMDMath.h"
 
 namespace librender
 {
 
-const int kCacheLineSize = 64;
-const int kBytesPerPixel = 4;
 const int kTileSize = 64;
 const int kVectorSize = 64;
+const int kBC1BlockSize = 8;
 
 static_assert(__builtin_clz(kTileSize) & 1, "Tile size must be power of four");
 
+// Insert a zero bit between each of the low 8 bits of value. Interleaving
+// two of these gives the Morton (Z) order index of a 2D coordinate.
+template <typename T>
+inline T spreadBits(T value)
+{
+    value = (value | (value << 4)) & 0x0f0f;
+    value = (value | (value << 2)) & 0x3333;
+    return (value | (value << 1)) & 0x5555;
+}
+
 //
 // Surface is a chunk of 2D bitmap memory.
 // Because this contains vector elements, this structure must be aligned to vector width.
 // If this is to be used as a destination, the width and height must be a multiple of
 // 64 bytes.
 //
+// Pixels are either stored in rows (kLinear), which is what the display
+// controller expects, or in tiles (kTiled). In the tiled layout, each 4x4
+// block of pixels is one cache line, blocks are stored in Morton order within
+// a tile, and each tile is contiguous in memory. Tiles are 64x64 pixels, or
+// smaller if the surface is. This makes readBlock/writeBlockMasked a single
+// vector load/store, and clearing or flushing a tile a sequential walk.
+// Tiled surfaces must have a width and height that are multiples of 4, and
+// memory is allocated for whole tiles.
+//
+// Pixels are normally 32-bit RGBA. Other formats are:
+//  - kRGB565, kR8 and kR16: smaller color formats. R8 and R16 only have a
+//    red channel, stored as an unsigned normalized value.
+//  - kD32F: 32-bit floating point depth.
+//  - kD16: 16-bit depth, stored as an unsigned normalized value between the
+//    limits set with setDepthRange. The steps are evenly spaced over the
+//    range, unlike a truncated float, which loses precision as depth values
+//    get farther from zero. Zero is reserved for the cleared state, which
+//    reads as -infinity like a cleared kD32F buffer.
+//  - kBC1: compressed 4x4 blocks, 8 bytes each, stored in rows of blocks
+//    (the layout must be kLinear). These can only be sampled by Texture,
+//    which decodes them.
+// The block and pixel accessors read and write raw pixel values, zero
+// extended to 32 bits. Pixels smaller than 32 bits are accessed with gathers
+// and scatters of the words that contain them. In the tiled layout, a 4x4
+// block of these is smaller than a cache line.
+//
 
 class Surface
 {
 public:
+    enum Layout
+    {
+        kLinear,
+        kTiled
+    };
+
+    enum Format
+    {
+        kRGBA8888,
+        kBC1,
+        kRGB565,
+        kR8,
+        kR16,
+        kD16,
+        kD32F
+    };
+
     // This allocates surface memory and frees it automatically.
-    Surface(int width, int height);
+    Surface(int width, int height, Layout layout = kLinear, Format format = kRGBA8888);
 
     // This will use the passed pointer as surface memory and will
-    // not attempt to free it.
-    Surface(int width, int height, void *base);
+    // not attempt to free it. It must be at least getAllocationSize()
+    // bytes.
+    Surface(int width, int height, void *base, Layout layout = kLinear,
+            Format format = kRGBA8888);
 
     ~Surface();
 
@@ -61,49 +116,174 @@ public:
     //  12 13 14 15
     void writeBlockMasked(int left, int top, vmask_t mask, vecu16_t values)
     {
-        veci16_t ptrs = f4x4AtOrigin + left * 4 + top * fStride;
-        __builtin_nyuzi_scatter_storei_masked(ptrs, values, mask);
+        TileState &state = fTileStates[tileStateIndex(left, top)];
+        if (state.pendingClear)
+            resolveTile(left, top);
+
+        // Only store when the state changes, since neighboring tiles that
+        // other threads are filling share cache lines with it.
+        if (!state.dirty || state.memoryCleared)
+        {
+            state.dirty = true;
+            state.memoryCleared = false;
+        }
+
+        if (fBytesPerPixel != 4)
+            writeNarrowPixels(blockPointers(left, top), values, mask);
+        else if (fLayout == kTiled)
+        {
+            __builtin_nyuzi_block_storei_masked(reinterpret_cast<vecu16_t*>(fBaseAddress
+                                                + tiledOffset(left, top)), values, mask);
+        }
+        else
+            __builtin_nyuzi_scatter_storei_masked(blockPointers(left, top), values, mask);
     }
 
     // Read values from a 4x4 block, in same order as writeBlockMasked
     vecu16_t readBlock(int left, int top) const
     {
-        veci16_t ptrs = f4x4AtOrigin + left * 4 + top * fStride;
-        return __builtin_nyuzi_gather_loadi(ptrs);
+        const TileState &state = fTileStates[tileStateIndex(left, top)];
+        if (state.pendingClear)
+            return state.clearValue;
+
+        if (fBytesPerPixel != 4)
+            return readNarrowPixels(blockPointers(left, top), 0xffff);
+
+        if (fLayout == kTiled)
+            return *reinterpret_cast<const vecu16_t*>(fBaseAddress + tiledOffset(left, top));
+
+        return __builtin_nyuzi_gather_loadi(blockPointers(left, top));
     }
 
-    // Set all 32-bit values in a tile to a predefined value.
-    void clearTile(int left, int top, unsigned int value)
+    // Read and write depth values in a 4x4 block, converting between
+    // floating point and the format of this surface.
+    vecf16_t readDepthBlock(int left, int top) const
     {
-        if (kTileSize == 64 && fWidth - left >= 64 && fHeight - top >= 64)
-        {
-            // Fast clear using block stores
-            vecu16_t vval = value;
-            vecu16_t *ptr = reinterpret_cast<vecu16_t*>(fBaseAddress + (left + top * fWidth) * kBytesPerPixel);
-            const int kStride = fStride / kCacheLineSize;
-            for (int y = 0; y < 64; y++)
-            {
-                ptr[0] = vval;
-                ptr[1] = vval;
-                ptr[2] = vval;
-                ptr[3] = vval;
-                ptr += kStride;
-            }
-        }
+        vecu16_t values = readBlock(left, top);
+        if (fFormat == kD16)
+            return unpackD16(values);
+
+        return vecf16_t(values);
+    }
+
+    void writeDepthBlockMasked(int left, int top, vmask_t mask, vecf16_t depth)
+    {
+        if (fFormat == kD16)
+            writeBlockMasked(left, top, mask, packD16(depth));
         else
-            clearTileSlow(left, top, value);
+            writeBlockMasked(left, top, mask, vecu16_t(depth));
+    }
+
+    // Set the depth values that the lowest and highest kD16 values represent.
+    // Depth values outside the range are clamped to it. The default is
+    // -1024.0 to 0.0. Smaller ranges have finer steps, so depth buffers
+    // should use the tightest range that covers the scene.
+    void setDepthRange(float farthest, float nearest)
+    {
+        fFarthestDepth = farthest;
+        fDepthToD16 = float(kMaxD16 - 1) / (nearest - farthest);
+        fD16ToDepth = (nearest - farthest) / float(kMaxD16 - 1);
+    }
+
+    // Raw value a depth buffer is cleared to, which reads as -infinity.
+    unsigned int getDepthClearValue() const
+    {
+        return fFormat == kD16 ? 0 : 0xff800000;
+    }
+
+    // Set all pixels in a tile to a predefined value, which is in the
+    // format of this surface.
+    void clearTile(int left, int top, unsigned int value)
+    {
+        TileState &state = fTileStates[tileStateIndex(left, top)];
+        clearTileMemory(left, top, value);
+        state.pendingClear = false;
+        state.memoryCleared = false;
+        state.dirty = true;
     }
 
+    // Record that a tile is cleared to a value without writing memory.
+    // Reading blocks from the tile returns the value until something is
+    // written to it. If the tile memory still holds the same value from a
+    // previous clear, this does nothing.
+    void fastClearTile(int left, int top, unsigned int value)
+    {
+        TileState &state = fTileStates[tileStateIndex(left, top)];
+        if (state.memoryCleared && state.clearValue == value)
+            return;
+
+        state.pendingClear = true;
+        state.memoryCleared = false;
+        state.clearValue = value;
+    }
+
+    // Write a pending fast clear to memory. This is necessary before reading
+    // the tile other than with readBlock, for example when sampling the
+    // surface as a texture.
+    void resolveTile(int left, int top);
+
     // Push a tile from the L2 cache back to system memory
     void flushTile(int left, int top);
 
+    // Push a tile back to system memory only if it has changed since it
+    // was last flushed. A pending fast clear is written with each cache line
+    // flushed as soon as it is filled, so it goes straight to memory without
+    // building up in the L2 cache.
+    void flushDirtyTile(int left, int top);
+
     veci16_t readPixels(veci16_t tx, veci16_t ty, vmask_t mask) const
     {
-        veci16_t pointers = (ty * fStride + tx * kBytesPerPixel)
-                            + fBaseAddress;
+        veci16_t pointers;
+        if (fLayout == kTiled)
+            pointers = tiledOffset(tx, ty) + fBaseAddress;
+        else
+            pointers = (ty * fStride + tx * fBytesPerPixel) + fBaseAddress;
+
+        if (fBytesPerPixel != 4)
+            return veci16_t(readNarrowPixels(pointers, mask));
+
         return __builtin_nyuzi_gather_loadi_masked(pointers, mask);
     }
 
+    // Convert between raw pixel values and floating point RGBA color
+    // channels (0.0-1.0). Formats without some channels read them as zero,
+    // except alpha, which reads as one. Depth formats read the depth value
+    // into the red, green and blue channels. This does not handle kBC1.
+    void unpackPixels(vecu16_t values, vecf16_t *outColor) const;
+    vecu16_t packPixels(const vecf16_t *color) const;
+
+    // Number of bytes of memory a surface with these parameters uses.
+    static int getAllocationSize(int width, int height, Layout layout,
+                                 Format format = kRGBA8888);
+
+    // Bytes between the starts of consecutive rows of a linear surface.
+    // Rows are padded to a multiple of four bytes.
+    static int getRowStride(int width, Format format);
+
+    // Size of a pixel for a format. This is zero for kBC1, which doesn't
+    // have individually addressable pixels.
+    static int getBytesPerPixel(Format format);
+
+    static bool isDepthFormat(Format format)
+    {
+        return format == kD16 || format == kD32F;
+    }
+
+    Layout getLayout() const
+    {
+        return fLayout;
+    }
+
+    Format getFormat() const
+    {
+        return fFormat;
+    }
+
+    int getBytesPerPixel() const
+    {
+        return fBytesPerPixel;
+    }
+
     inline int getWidth() const
     {
         return fWidth;
@@ -114,6 +294,7 @@ public:
         return fHeight;
     }
 
+    // Only meaningful for linear surfaces.
     inline int getStride() const
     {
         return fStride;
@@ -141,11 +322,77 @@ public:
     }
 
 private:
+    // Clear state for each kTileSize render tile. Because each render tile
+    // is only filled by one thread at a time, this needs no locking.
+    struct TileState
+    {
+        unsigned int clearValue = 0;
+        bool pendingClear = false;  // Cleared, but not written to memory yet
+        bool memoryCleared = false; // Memory holds clearValue, unmodified since
+        bool dirty = false;         // Written since last flush
+    };
+
+    int tileStateIndex(int left, int top) const
+    {
+        return (top / kTileSize) * fTileStateColumns + left / kTileSize;
+    }
+
+    static const int kMaxD16 = 0xffff;
+
+    // kD16 values from 1 to kMaxD16 cover the depth range. 0 is -infinity.
+    vecu16_t packD16(vecf16_t depth) const
+    {
+        vecf16_t scaled = clamp((depth - fFarthestDepth) * fDepthToD16, 0.0f,
+                                float(kMaxD16 - 1));
+        return __builtin_convertvector(scaled, vecu16_t) + 1u;
+    }
+
+    vecf16_t unpackD16(vecu16_t values) const
+    {
+        vecf16_t depth = __builtin_convertvector(veci16_t(values) - 1, vecf16_t) * fD16ToDepth
+                         + fFarthestDepth;
+        return __builtin_nyuzi_vector_mixf(__builtin_nyuzi_mask_cmpi_eq(veci16_t(values),
+                                           veci16_t(0)), vecf16_t(-__builtin_inff()), depth);
+    }
+
+    static int getTileShift(int width, int height, Layout layout);
+    void initializeTileStates();
+    unsigned int replicatePixel(unsigned int value) const;
+    void clearTileMemory(int left, int top, unsigned int value);
+    void streamClearTile(int left, int top, unsigned int value);
     void initializeOffsetVectors();
     void clearTileSlow(int left, int top, unsigned int value);
+    void clearTileTiled(int left, int top, unsigned int value);
+    vecu16_t readNarrowPixels(veci16_t pointers, vmask_t mask) const;
+    void writeNarrowPixels(veci16_t pointers, vecu16_t values, vmask_t mask);
+
+    // Addresses of the pixels in a 4x4 block
+    veci16_t blockPointers(int left, int top) const
+    {
+        if (fLayout == kTiled)
+            return fTiledBlockOffsets + tiledOffset(left, top);
+
+        return f4x4AtOrigin + left * fBytesPerPixel + top * fStride;
+    }
+
+    // Byte offset of a pixel in a tiled surface. This works on either
+    // scalars or vectors of coordinates.
+    template <typename T>
+    T tiledOffset(T x, T y) const
+    {
+        int tileMask = (1 << fTileShift) - 1;
+        T tileIndex = (y >> fTileShift) * fTileColumns + (x >> fTileShift);
+        T blockIndex = spreadBits((x & tileMask) >> 2) | (spreadBits((y & tileMask) >> 2) << 1);
+        return ((tileIndex << (fTileShift * 2)) + (blockIndex << 4) + (y & 3) * 4 + (x & 3))
+               * fBytesPerPixel;
+    }
 
     veci16_t f4x4AtOrigin;
 
+    // Offset of each pixel in a 4x4 block from the start of the block, for
+    // tiled surfaces with pixels smaller than 32 bits.
+    veci16_t fTiledBlockOffsets;
+
     // For each pixel in a 4x4 grid, these represent the distance in
     // screen coordinates (-1.0 to 1.0) from the upper left pixel.
     vecf16_t fXStep;
@@ -154,8 +401,18 @@ private:
     int fWidth;
     int fHeight;
     int fStride;
+    int fBytesPerPixel;
     int fBaseAddress;
     bool fOwnedPointer;
+    Layout fLayout;
+    Format fFormat;
+    int fTileShift;	// log2 of tile width in pixels, for tiled layout
+    int fTileColumns;
+    TileState *fTileStates;
+    int fTileStateColumns;
+    float fFarthestDepth = -1024.0f;
+    float fDepthToD16 = float(kMaxD16 - 1) / 1024.0f;
+    float fD16ToDepth = 1024.0f / float(kMaxD16 - 1);
 
 };
 
@@ -27,20 +27,67 @@ namespace librender
 namespace
 {
 
-const float kOneOver255 = 1.0 / 255.0;
+// Convert RGB565 colors into three floating point (0.0 - 1.0) color channels.
+void unpackRGB565(veci16_t packedColor, vecf16_t *outColor)
+{
+    outColor[kColorR] = __builtin_convertvector((packedColor >> 11) & 31, vecf16_t)
+                        * (1.0f / 31.0f);
+    outColor[kColorG] = __builtin_convertvector((packedColor >> 5) & 63, vecf16_t)
+                        * (1.0f / 63.0f);
+    outColor[kColorB] = __builtin_convertvector(packedColor & 31, vecf16_t)
+                        * (1.0f / 31.0f);
+}
+
+// Decode one texel from each of up to 16 BC1 compressed blocks. A block
+// has two RGB565 endpoint colors followed by a 2-bit palette index for each
+// texel. If the first endpoint is larger, indices 2 and 3 are 1/3 and 2/3
+// of the way between the endpoints. Otherwise index 2 is the midpoint and
+// index 3 is transparent black.
+void decodeBC1(const Surface *surface, veci16_t tx, veci16_t ty, vmask_t mask,
+               vecf16_t *outColor)
+{
+    veci16_t blockPtr = ((ty >> 2) * (surface->getWidth() / 4) + (tx >> 2)) * kBC1BlockSize
+                        + reinterpret_cast<int>(surface->bits());
+    veci16_t endpoints = __builtin_nyuzi_gather_loadi_masked(blockPtr, mask);
+    veci16_t indices = __builtin_nyuzi_gather_loadi_masked(blockPtr + 4, mask);
+    veci16_t selector = (indices >> (((ty & 3) * 4 + (tx & 3)) * 2)) & 3;
+    veci16_t color0 = endpoints & 0xffff;
+    veci16_t color1 = (endpoints >> 16) & 0xffff;
+    vmask_t fourColor = __builtin_nyuzi_mask_cmpi_sgt(color0, color1);
+    vmask_t transparent = __builtin_nyuzi_mask_cmpi_eq(selector, veci16_t(3)) & ~fourColor;
+
+    // Weight of the second endpoint for each palette index
+    vecf16_t weight = __builtin_nyuzi_vector_mixf(__builtin_nyuzi_mask_cmpi_eq(selector,
+                      veci16_t(1)), vecf16_t(1.0f), vecf16_t(0.0f));
+    weight = __builtin_nyuzi_vector_mixf(__builtin_nyuzi_mask_cmpi_eq(selector, veci16_t(2)),
+                                         __builtin_nyuzi_vector_mixf(fourColor,
+                                                 vecf16_t(1.0f / 3.0f), vecf16_t(0.5f)), weight);
+    weight = __builtin_nyuzi_vector_mixf(__builtin_nyuzi_mask_cmpi_eq(selector, veci16_t(3)),
+                                         vecf16_t(2.0f / 3.0f), weight);
+
+    vecf16_t endpoint0[3];
+    vecf16_t endpoint1[3];
+    unpackRGB565(color0, endpoint0);
+    unpackRGB565(color1, endpoint1);
+    for (int channel = 0; channel < 3; channel++)
+    {
+        outColor[channel] = __builtin_nyuzi_vector_mixf(transparent, vecf16_t(0.0f),
+                            endpoint0[channel] + (endpoint1[channel] - endpoint0[channel])
+                            * weight);
+    }
+
+    outColor[kColorA] = __builtin_nyuzi_vector_mixf(transparent, vecf16_t(0.0f),
+                        vecf16_t(1.0f));
+}
 
-// Convert a 32-bit RGBA color (packed in an integer) into four floating point (0.0 - 1.0)
-// color channels.
-void unpackRGBA(veci16_t packedColor, vecf16_t *outColor)
+// Read texels and convert them to floating point color channels.
+void readTexels(const Surface *surface, veci16_t tx, veci16_t ty, vmask_t mask,
+                vecf16_t *outColor)
 {
-    outColor[kColorR] = __builtin_convertvector(packedColor & 255, vecf16_t)
-                        * kOneOver255;
-    outColor[kColorG] = __builtin_convertvector((packedColor >> 8) & 255,
-                        vecf16_t) * kOneOver255;
-    outColor[kColorB] = __builtin_convertvector((packedColor >> 16) & 255,
-                        vecf16_t) * kOneOver255;
-    outColor[kColorA] = __builtin_convertvector((packedColor >> 24) & 255,
-                        vecf16_t) * kOneOver255;
+    if (surface->getFormat() == Surface::kBC1)
+        decodeBC1(surface, tx, ty, mask, outColor);
+    else
+        surface->unpackPixels(vecu16_t(surface->readPixels(tx, ty, mask)), outColor);
 }
 
 // Convert a number in the range -1.0 <= n <= 1.0 to 0.0 <= n < 1.0
@@ -51,6 +98,17 @@ inline vecf16_t wrapfv(vecf16_t in)
                                        in + vecf16_t(1.0), in);
 }
 
+// Approximate log2 of positive values. This is the exponent plus the
+// mantissa interpolated linearly, which is exact at powers of two.
+// The integer casts do not perform float/int conversions.
+inline vecf16_t log2fv(vecf16_t in)
+{
+    veci16_t bits = veci16_t(in);
+    vecf16_t exponent = __builtin_convertvector(((bits >> 23) & 255) - 127, vecf16_t);
+    vecf16_t mantissa = vecf16_t((bits & 0x7fffff) | 0x3f800000);
+    return exponent + mantissa - 1.0f;
+}
+
 // If a number is greater than max, make it be zero.
 // This wraps in the case that 0 <= in <= max.
 inline veci16_t wrapiv(veci16_t in, int max)
@@ -77,8 +135,6 @@ void Texture::setMipSurface(int mipLevel, const Surface *surface)
 
     if (mipLevel == 0)
     {
-        fBaseMipBits = __builtin_clz(static_cast<unsigned int>(surface->getWidth())) + 1;
-
         // Clear out lower mip levels
         for (int i = 1; i < fMaxMipLevel; i++)
             fMipSurfaces[i] = 0;
@@ -94,18 +150,106 @@ void Texture::setMipSurface(int mipLevel, const Surface *surface)
 void Texture::readPixels(vecf16_t u, vecf16_t v, vmask_t mask,
                          vecf16_t *outColor) const
 {
-    // Determine the closest mip-level. Compute the pitch between the top
-    // two pixels. The reciprocal of this is the scaled texture size. log2 of this
-    // is the mip level.
-    // XXX this is a hack because it only looks at one direction. Should do
-    // something better here.
-    int mipLevel = __builtin_clz(static_cast<unsigned int>(1.0f /
-                                 __builtin_fabsf(u[1] - u[0]))) - fBaseMipBits;
-    if (mipLevel > fMaxMipLevel)
-        mipLevel = fMaxMipLevel;
-    else if (mipLevel < 0)
-        mipLevel = 0;
+    if (fMaxMipLevel == 0)
+    {
+        readLevel(0, u, v, mask, outColor);
+        return;
+    }
+
+    vecf16_t lod;
+    computeLod(u, v, &lod);
+
+    // Each lane reads from lowerLevel and, if trilinear filtering is
+    // enabled, lowerLevel + 1, weighted by the fractional part of the LOD.
+    // Because the LOD is computed per 2x2 quad, there are at most four
+    // distinct levels in the block, so read each level that is used for the
+    // lanes that need it and accumulate.
+    lod = clamp(lod, 0.0f, static_cast<float>(fMaxMipLevel));
+    veci16_t lowerLevel = __builtin_convertvector(lod, veci16_t);
+    vecf16_t upperWeight;
+    if (fEnableTrilinearFiltering)
+        upperWeight = lod - __builtin_convertvector(lowerLevel, vecf16_t);
+    else
+        upperWeight = vecf16_t(0.0f);
+
+    veci16_t upperLevel = lowerLevel + 1;
+    for (int channel = 0; channel < 4; channel++)
+        outColor[channel] = vecf16_t(0.0f);
+
+    int minLevel = fMaxMipLevel;
+    int maxLevel = 0;
+    for (int lane = 0; lane < 16; lane++)
+    {
+        if (mask & (1 << lane))
+        {
+            minLevel = min(minLevel, lowerLevel[lane]);
+            maxLevel = max(maxLevel, lowerLevel[lane]);
+        }
+    }
+
+    if (fEnableTrilinearFiltering)
+        maxLevel = min(maxLevel + 1, fMaxMipLevel);
+
+    for (int level = minLevel; level <= maxLevel; level++)
+    {
+        vmask_t lowerMask = __builtin_nyuzi_mask_cmpi_eq(lowerLevel, veci16_t(level));
+        vmask_t upperMask = fEnableTrilinearFiltering
+                            ? __builtin_nyuzi_mask_cmpi_eq(upperLevel, veci16_t(level)) : 0;
+        vmask_t levelMask = (lowerMask | upperMask) & mask;
+        if (levelMask == 0)
+            continue;
 
+        vecf16_t lowerWeight = __builtin_nyuzi_vector_mixf(lowerMask, 1.0f - upperWeight,
+                               vecf16_t(0.0f));
+        vecf16_t weight = __builtin_nyuzi_vector_mixf(upperMask, lowerWeight + upperWeight,
+                          lowerWeight);
+        vecf16_t levelColor[4];
+        readLevel(level, u, v, levelMask, levelColor);
+        for (int channel = 0; channel < 4; channel++)
+        {
+            outColor[channel] += __builtin_nyuzi_vector_mixf(levelMask,
+                                 levelColor[channel] * weight, vecf16_t(0.0f));
+        }
+    }
+}
+
+//
+// Compute the level of detail for each lane. The lanes are a 4x4 block of
+// pixels. For each 2x2 quad, take the differences in texel coordinates
+// (at the base level) to the pixel to the right and the pixel below. The
+// LOD is log2 of the longer of those two vectors. All lanes in a quad get
+// the same value.
+//
+void Texture::computeLod(vecf16_t u, vecf16_t v, vecf16_t *outLod) const
+{
+    const veci16_t kQuadTopLeft = { 0, 0, 2, 2, 0, 0, 2, 2, 8, 8, 10, 10, 8, 8, 10, 10 };
+    const veci16_t kQuadTopRight = kQuadTopLeft + 1;
+    const veci16_t kQuadBottomLeft = kQuadTopLeft + 4;
+
+    float baseWidth = static_cast<float>(fMipSurfaces[0]->getWidth());
+    float baseHeight = static_cast<float>(fMipSurfaces[0]->getHeight());
+    vecf16_t uTopLeft = __builtin_nyuzi_shufflef(u, kQuadTopLeft);
+    vecf16_t vTopLeft = __builtin_nyuzi_shufflef(v, kQuadTopLeft);
+    vecf16_t uTopRight = __builtin_nyuzi_shufflef(u, kQuadTopRight);
+    vecf16_t vTopRight = __builtin_nyuzi_shufflef(v, kQuadTopRight);
+    vecf16_t uBottomLeft = __builtin_nyuzi_shufflef(u, kQuadBottomLeft);
+    vecf16_t vBottomLeft = __builtin_nyuzi_shufflef(v, kQuadBottomLeft);
+    vecf16_t dudx = (uTopRight - uTopLeft) * baseWidth;
+    vecf16_t dvdx = (vTopRight - vTopLeft) * baseHeight;
+    vecf16_t dudy = (uBottomLeft - uTopLeft) * baseWidth;
+    vecf16_t dvdy = (vBottomLeft - vTopLeft) * baseHeight;
+    vecf16_t rhoSquared = max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy);
+
+    // log2(sqrt(x)) = log2(x) / 2. Avoid taking the log of zero.
+    *outLod = log2fv(max(rhoSquared, vecf16_t(1.0f))) * 0.5f;
+}
+
+//
+// Sample one mip level, with nearest or bilinear filtering.
+//
+void Texture::readLevel(int mipLevel, vecf16_t u, vecf16_t v, vmask_t mask,
+                        vecf16_t *outColor) const
+{
     const Surface *surface = fMipSurfaces[mipLevel];
     int mipWidth = surface->getWidth();
     int mipHeight = surface->getHeight();
@@ -130,10 +274,10 @@ void Texture::readPixels(vecf16_t u, vecf16_t v, vmask_t mask,
         veci16_t xPlusOne = wrapiv(tx + 1, mipWidth);
         veci16_t yPlusOne = wrapiv(ty + 1, mipHeight);
 
-        unpackRGBA(surface->readPixels(tx, ty, mask), tlColor);
-        unpackRGBA(surface->readPixels(tx, yPlusOne, mask), blColor);
-        unpackRGBA(surface->readPixels(xPlusOne, ty, mask), trColor);
-        unpackRGBA(surface->readPixels(xPlusOne, yPlusOne, mask), brColor);
+        readTexels(surface, tx, ty, mask, tlColor);
+        readTexels(surface, tx, yPlusOne, mask, blColor);
+        readTexels(surface, xPlusOne, ty, mask, trColor);
+        readTexels(surface, xPlusOne, yPlusOne, mask, brColor);
 
         // Compute weights
         vecf16_t wu = fracfv(uRaster);
@@ -155,7 +299,7 @@ void Texture::readPixels(vecf16_t u, vecf16_t v, vmask_t mask,
     else
     {
         // Nearest neighbor
-        unpackRGBA(surface->readPixels(tx, ty, mask), outColor);
+        readTexels(surface, tx, ty, mask, outColor);
     }
 }
 
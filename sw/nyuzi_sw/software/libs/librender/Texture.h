@@ -32,13 +32,17 @@ public:
     Texture(const Texture&) = delete;
     Texture& operator=(const Texture&) = delete;
 
-    // Set the source raster data for a mip level.
+    // Set the source raster data for a mip level. Surfaces may be
+    // uncompressed or BC1 compressed (see Surface::Format), and all levels
+    // should use the same format.
     // This does not take ownership of the surfaces and will not free them.
     // mipLevel 0 must be set before higher levels. Calling this with miplevel
     // 0 after setting other levels will clear the other levels.
     void setMipSurface(int mipLevel, const Surface *surface);
 
-    // Read up to 16 pixel values
+    // Read up to 16 pixel values. The lanes must be a 4x4 block of pixels
+    // arranged as in Surface::writeBlockMasked. The mip level is chosen for
+    // each 2x2 quad from the change in u and v across it.
     // @param u Horizontal coordinates, each is 0.0-1.0
     // @param v Vertical coordinates, 0.0-1.0
     // @param mask each bit corresponds to a vector lane. A 1 indicates the pixel
@@ -55,10 +59,21 @@ public:
         fEnableBilinearFiltering = enable;
     }
 
+    // If enable is true, this will blend between the two closest mip levels
+    // instead of choosing the nearest one.
+    void enableTrilinearFiltering(bool enable)
+    {
+        fEnableTrilinearFiltering = enable;
+    }
+
 private:
+    void computeLod(vecf16_t u, vecf16_t v, vecf16_t *outLod) const;
+    void readLevel(int mipLevel, vecf16_t u, vecf16_t v, vmask_t mask,
+                   vecf16_t *outColor) const;
+
     const Surface *fMipSurfaces[kMaxMipLevels];
     bool fEnableBilinearFiltering = false;
-    int fBaseMipBits = 0;
+    bool fEnableTrilinearFiltering = false;
     int fMaxMipLevel = 0;
 };
 
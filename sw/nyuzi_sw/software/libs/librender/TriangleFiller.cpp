@@ -21,11 +21,32 @@
 namespace librender
 {
 
+namespace
+{
+
+const float kInfinity = __builtin_inff();
+
+inline float min3(float a, float b, float c)
+{
+    float value = a < b ? a : b;
+    return c < value ? c : value;
+}
+
+inline float max3(float a, float b, float c)
+{
+    float value = a > b ? a : b;
+    return c > value ? c : value;
+}
+
+} // namespace
+
 TriangleFiller::TriangleFiller(RenderTarget *target)
     :  fTarget(target),
-       fTwoOverWidth(2.0f / target->getColorBuffer()->getWidth()),
-       fTwoOverHeight(2.0f / target->getColorBuffer()->getHeight()),
-       fOneOverZInterpolator()
+       fTwoOverWidth(2.0f / target->getPrimarySurface()->getWidth()),
+       fTwoOverHeight(2.0f / target->getPrimarySurface()->getHeight()),
+       fOneOverZInterpolator(),
+       fCoarseDepth(-kInfinity),
+       fTileFarthestZ(-kInfinity)
 {
 }
 
@@ -52,7 +73,8 @@ void TriangleFiller::setUpTriangle(const RenderState *state,
     fZ0 = z0;
     fZ1 = z1;
     fZ2 = z2;
-
+    fNearestZ = max3(z0, z1, z2);
+    fFarthestZ = min3(z0, z1, z2);
 
     // The following system of equations describes the relationship
     // between the vertical and horizontal gradients (gx, gy),
@@ -84,6 +106,7 @@ void TriangleFiller::setUpTriangle(const RenderState *state,
         setUpInterpolator(fOneOverZInterpolator, 1.0f / z0, 1.0f / z1, 1.0f / z2);
     }
 
+    fFillFunction = state->fFillFunctions[fNeedPerspective ? 1 : 0];
     fNumParams = 0;
 }
 
@@ -106,17 +129,15 @@ void TriangleFiller::setUpInterpolator(LinearInterpolator &interpolator, float c
 // triangle points specified in setUpTriangle.
 void TriangleFiller::setUpParam(float c0, float c1, float c2)
 {
-    if (c0 == c1 && c0 == c2)
-    {
-        // If this is a constant, we can skip interpolation.
-        fParameters[fNumParams].isConstant = true;
-        fParameters[fNumParams].constantValue = c0;
-    }
-    else if (fNeedPerspective)
+    // The generic fill path skips interpolation for constants. Specialized
+    // paths interpolate every parameter rather than checking, so set up the
+    // interpolator either way.
+    fParameters[fNumParams].isConstant = c0 == c1 && c0 == c2;
+    fParameters[fNumParams].constantValue = c0;
+    if (fNeedPerspective)
     {
         // Perspective interpolator.
         // These must be divided by Z to be perspective correct, as described above.
-        fParameters[fNumParams].isConstant = false;
         setUpInterpolator(fParameters[fNumParams].linearInterpolator,
                           c0 / fZ0, c1 / fZ1, c2 / fZ2);
     }
@@ -124,7 +145,6 @@ void TriangleFiller::setUpParam(float c0, float c1, float c2)
     {
         // Non-perspective interpolator. If all Zs are the same, we can just do linear
         // interpolation and save extra divisions.
-        fParameters[fNumParams].isConstant = false;
         setUpInterpolator(fParameters[fNumParams].linearInterpolator,
                           c0, c1, c2);
     }
@@ -132,86 +152,46 @@ void TriangleFiller::setUpParam(float c0, float c1, float c2)
     fNumParams++;
 }
 
-void TriangleFiller::fillMasked(int left, int top, vmask_t mask)
+void TriangleFiller::resetCoarseDepth(int tileLeft, int tileTop)
 {
-    // Convert from raster to screen space coordinates.
-    vecf16_t x = fTarget->getColorBuffer()->getXStep() + (left * fTwoOverWidth - 1.0f);
-    vecf16_t y = 1.0f - top * fTwoOverHeight - fTarget->getColorBuffer()->getYStep();
-
-    // Depth buffer
-    vecf16_t zValues;
-    if (fNeedPerspective)
-        zValues = 1.0f / fOneOverZInterpolator.getValuesAt(x, y);
-    else
-        zValues = fZ0;
-
-    if (fState->fEnableDepthBuffer)
-    {
-        vecf16_t depthBufferValues = vecf16_t(fTarget->getDepthBuffer()->readBlock(left, top));
-        int passDepthTest = __builtin_nyuzi_mask_cmpf_gt(zValues, depthBufferValues);
-
-        // Early Z optimization: any pixels that fail the Z test are removed
-        // from the pixel mask.
-        mask &= passDepthTest;
-        if (mask == 0)
-            return; // All pixels are occluded
-
-        fTarget->getDepthBuffer()->writeBlockMasked(left, top, mask, vecu16_t(zValues));
-    }
-
-    // Interpolate parameters
-    vecf16_t interpolatedParams[kMaxParams];
-    for (int paramIndex = 0; paramIndex < fNumParams; paramIndex++)
+    // The depth buffer was just cleared to -infinity. Blocks that are
+    // entirely outside the render target never receive pixels, so treat them
+    // as infinitely near. That way they don't keep the whole tile from being
+    // occluded.
+    const int kBlockSize = kTileSize / 4;
+    int width = fTarget->getPrimarySurface()->getWidth();
+    int height = fTarget->getPrimarySurface()->getHeight();
+    fCoarseDepth = -kInfinity;
+    for (int blockIndex = 0; blockIndex < 16; blockIndex++)
     {
-        if (fParameters[paramIndex].isConstant)
-            interpolatedParams[paramIndex] = fParameters[paramIndex].constantValue;
-        else if (fNeedPerspective)
-        {
-            interpolatedParams[paramIndex] = fParameters[paramIndex].linearInterpolator
-                                             .getValuesAt(x, y) * zValues;
-        }
-        else
-        {
-            interpolatedParams[paramIndex] = fParameters[paramIndex].linearInterpolator
-                                             .getValuesAt(x, y);
-        }
+        if (tileLeft + (blockIndex & 3) * kBlockSize >= width
+                || tileTop + (blockIndex >> 2) * kBlockSize >= height)
+            fCoarseDepth[blockIndex] = kInfinity;
     }
 
-    // Shade
-    vecf16_t color[4];
-    fState->fShader->shadePixels(color, interpolatedParams, fState->fUniforms, fState->fTextures,
-                                 mask);
-
-    // Convert color channels to 8bpp
-    vecu16_t rS = __builtin_convertvector(clamp(color[kColorR], 0.0, 1.0) * 255.0f, vecu16_t);
-    vecu16_t gS = __builtin_convertvector(clamp(color[kColorG], 0.0, 1.0) * 255.0f, vecu16_t);
-    vecu16_t bS = __builtin_convertvector(clamp(color[kColorB], 0.0, 1.0) * 255.0f, vecu16_t);
-
-    vecu16_t pixelValues;
+    fTileFarthestZ = -kInfinity;
+}
 
-    // If all pixels are fully opaque, don't bother trying to blend them.
-    if (fState->fEnableBlend
-            && (__builtin_nyuzi_mask_cmpf_lt(color[kColorA], vecf16_t(1.0f)) & mask) != 0)
-    {
-        vecu16_t aS = __builtin_convertvector(clamp(color[kColorA], 0.0, 1.0) * 255.0f, vecu16_t)
-                      & 0xff;
-        vecu16_t oneMinusAS = 255 - aS;
-
-        vecu16_t destColors = vecu16_t(fTarget->getColorBuffer()->readBlock(left, top));
-        vecu16_t rD = destColors & 0xff;
-        vecu16_t gD = (destColors >> 8) & 0xff;
-        vecu16_t bD = (destColors >> 16) & 0xff;
-
-        // Premultiplied alpha
-        vecu16_t newR = saturate(((rS << 8) + (rD * oneMinusAS)) >> 8, 255);
-        vecu16_t newG = saturate(((gS << 8) + (gD * oneMinusAS)) >> 8, 255);
-        vecu16_t newB = saturate(((bS << 8) + (bD * oneMinusAS)) >> 8, 255);
-        pixelValues = 0xff000000 | newR | (newG << 8) | (newB << 16);
-    }
-    else
-        pixelValues = 0xff000000 | rS | (gS << 8) | (bS << 16);
+void TriangleFiller::coverBlock(int blockIndex)
+{
+    if (!fState->fEnableDepthBuffer || !fState->fEnableDepthWrite
+            || fCoarseDepth[blockIndex] >= fFarthestZ)
+        return;
+
+    // The triangle covered every pixel in the block. Pixels that passed the
+    // depth test now hold its depth, and the others were already nearer, so
+    // none can be farther than the farthest point of the triangle.
+    fCoarseDepth[blockIndex] = fFarthestZ;
+    float tileFarthest = fCoarseDepth[0];
+    for (int i = 1; i < 16; i++)
+        tileFarthest = min(tileFarthest, static_cast<float>(fCoarseDepth[i]));
+
+    fTileFarthestZ = tileFarthest;
+}
 
-    fTarget->getColorBuffer()->writeBlockMasked(left, top, mask, vecu16_t(pixelValues));
+FillFunction TriangleFiller::getGenericFillFunction(const RenderState &state, bool perspective)
+{
+    return selectFillFunction<Shader, -1>(state, perspective);
 }
 
 } // namespace librender
@@ -28,6 +28,29 @@ namespace librender
 
 const int kMaxParams = 16;
 
+// Calls shadePixels directly for a concrete shader type, so it can be
+// inlined. The generic Shader calls it virtually.
+template <typename ShaderType>
+struct ShadePixelsCall
+{
+    static void call(const Shader *shader, vecf16_t *outColor, const vecf16_t *inParams,
+                     const void *uniforms, const Texture * const *sampler, vmask_t mask)
+    {
+        static_cast<const ShaderType*>(shader)->ShaderType::shadePixels(outColor, inParams,
+                uniforms, sampler, mask);
+    }
+};
+
+template <>
+struct ShadePixelsCall<Shader>
+{
+    static void call(const Shader *shader, vecf16_t *outColor, const vecf16_t *inParams,
+                     const void *uniforms, const Texture * const *sampler, vmask_t mask)
+    {
+        shader->shadePixels(outColor, inParams, uniforms, sampler, mask);
+    }
+};
+
 //
 // This delegate shades pixels and writes them to the render target.
 // It maintains state for one triangle at a time. The rasterizer calls
@@ -44,7 +67,28 @@ public:
     // The rasterizer calls this to fill a 4x4 block.  The left and top
     // coordinates are raster coordinates (count of pixels from the upper
     // left corner).
-    void fillMasked(int left, int top, vmask_t mask);
+    void fillMasked(int left, int top, vmask_t mask)
+    {
+        fFillFunction(*this, left, top, mask);
+    }
+
+    // The fill pipeline, specialized at compile time for a shader type and
+    // render state. Branches on that state and the virtual call to the
+    // shader are resolved when the function is instantiated, and the loop
+    // over parameters is unrolled. A kNumParams of -1 reads the count from
+    // the triangle, and ShaderType of Shader calls shadePixels virtually,
+    // which is the generic path for shaders that aren't SpecializedShaders.
+    // kCountSamples is set for draw calls in an occlusion query.
+    template <typename ShaderType, bool kEnableDepth, bool kEnableBlend, bool kPerspective,
+              bool kCountSamples, int kNumParams>
+    static void fillBlock(TriangleFiller &filler, int left, int top, vmask_t mask);
+
+    // Pick the instantiation of fillBlock for a draw call.
+    template <typename ShaderType, int kNumParams>
+    static FillFunction selectFillFunction(const RenderState &state, bool perspective);
+
+    // Fill function for shaders that don't provide a specialized one.
+    static FillFunction getGenericFillFunction(const RenderState &state, bool perspective);
 
     // This is called before setUpParam. The coordinates represent the
     // on-screen position of the triangle.
@@ -58,10 +102,50 @@ public:
     // parameter at each of the three triangle points.
     void setUpParam(float c1, float c2, float c3);
 
+    // Reset the coarse depth values at the start of a tile. This must be
+    // called after the depth buffer for the tile is cleared.
+    void resetCoarseDepth(int tileLeft, int tileTop);
+
+    // Returns true if a triangle whose nearest depth value is nearestZ
+    // would fail the depth test for every pixel in the tile. This can be
+    // called before setUpTriangle.
+    bool isTileOccluded(float nearestZ) const
+    {
+        return nearestZ <= fTileFarthestZ;
+    }
+
+    // Returns a mask of the coarse blocks in the tile (one bit for each
+    // kTileSize / 4 square block, in the same order as the rasterizer
+    // subdivides a tile) that the current triangle is completely behind.
+    vmask_t occludedBlocks() const
+    {
+        if (!fState->fEnableDepthBuffer)
+            return 0;
+
+        return __builtin_nyuzi_mask_cmpf_ge(fCoarseDepth, vecf16_t(fNearestZ));
+    }
+
+    // Returns the number of pixels that passed the depth test since the
+    // last call. Only draw calls with an occlusion query count them.
+    int takeSamplesPassed()
+    {
+        int count = fSamplesPassed;
+        fSamplesPassed = 0;
+        return count;
+    }
+
+    // The rasterizer calls this after the current triangle has covered every
+    // pixel of a coarse block, which moves the farthest depth value of that
+    // block forward.
+    void coverBlock(int blockIndex);
+
 private:
     void setUpInterpolator(LinearInterpolator &interpolator, float c0, float c1,
                            float c2);
 
+    template <bool kEnableBlend>
+    void writeColor(Surface *colorBuffer, int left, int top, vmask_t mask, vecf16_t *color);
+
     const RenderState *fState = nullptr;
     RenderTarget *fTarget;
 
@@ -85,6 +169,18 @@ private:
     float fX0;
     float fY0;
     bool fNeedPerspective;
+    FillFunction fFillFunction = nullptr;
+
+    // Hierarchical depth. Each lane holds a conservative farthest depth value
+    // for one coarse block of the tile. fTileFarthestZ is the minimum of
+    // those. fNearestZ and fFarthestZ are the depth bounds of the current
+    // triangle.
+    vecf16_t fCoarseDepth;
+    float fTileFarthestZ;
+    float fNearestZ;
+    float fFarthestZ;
+
+    int fSamplesPassed = 0;
 
     // Inverse gradient matrix
     float fInvGradientMatrix00;
@@ -93,4 +189,153 @@ private:
     float fInvGradientMatrix11;
 };
 
+template <typename ShaderType, bool kEnableDepth, bool kEnableBlend, bool kPerspective,
+          bool kCountSamples, int kNumParams>
+void TriangleFiller::fillBlock(TriangleFiller &filler, int left, int top, vmask_t mask)
+{
+    // Convert from raster to screen space coordinates.
+    RenderTarget *target = filler.fTarget;
+    Surface *colorBuffer = target->getColorBuffer();
+    Surface *primarySurface = target->getPrimarySurface();
+    vecf16_t x = primarySurface->getXStep() + (left * filler.fTwoOverWidth - 1.0f);
+    vecf16_t y = 1.0f - top * filler.fTwoOverHeight - primarySurface->getYStep();
+
+    // Depth buffer
+    vecf16_t zValues;
+    if (kPerspective)
+        zValues = 1.0f / filler.fOneOverZInterpolator.getValuesAt(x, y);
+    else
+        zValues = filler.fZ0;
+
+    if (kEnableDepth)
+    {
+        Surface *depthBuffer = target->getDepthBuffer();
+        vecf16_t depthBufferValues = depthBuffer->readDepthBlock(left, top);
+        int passDepthTest = __builtin_nyuzi_mask_cmpf_gt(zValues, depthBufferValues);
+
+        // Early Z optimization: any pixels that fail the Z test are removed
+        // from the pixel mask.
+        mask &= passDepthTest;
+        if (mask == 0)
+            return; // All pixels are occluded
+
+        if (filler.fState->fEnableDepthWrite)
+            depthBuffer->writeDepthBlockMasked(left, top, mask, zValues);
+    }
+
+    if (kCountSamples)
+        filler.fSamplesPassed += __builtin_popcount(mask);
+
+    // A depth-only target, or a draw call that doesn't write color, doesn't
+    // need the pixels to be shaded.
+    if (colorBuffer == nullptr || !filler.fState->fEnableColorWrite)
+        return;
+
+    // Interpolate parameters. When the count is known, setUpParam has set
+    // up an interpolator for constant parameters too, so this doesn't need
+    // to check each one.
+    vecf16_t interpolatedParams[kMaxParams];
+    const int numParams = kNumParams < 0 ? filler.fNumParams : kNumParams;
+    for (int paramIndex = 0; paramIndex < numParams; paramIndex++)
+    {
+        if (kNumParams < 0 && filler.fParameters[paramIndex].isConstant)
+            interpolatedParams[paramIndex] = filler.fParameters[paramIndex].constantValue;
+        else
+        {
+            interpolatedParams[paramIndex] = filler.fParameters[paramIndex].linearInterpolator
+                                             .getValuesAt(x, y);
+            if (kPerspective)
+                interpolatedParams[paramIndex] *= zValues;
+        }
+    }
+
+    // Shade
+    const RenderState *state = filler.fState;
+    vecf16_t color[4];
+    ShadePixelsCall<ShaderType>::call(state->fShader, color, interpolatedParams,
+                                      state->fUniforms, state->fTextures, mask);
+
+    filler.writeColor<kEnableBlend>(colorBuffer, left, top, mask, color);
+}
+
+template <bool kEnableBlend>
+void TriangleFiller::writeColor(Surface *colorBuffer, int left, int top, vmask_t mask,
+                                vecf16_t *color)
+{
+    // If all pixels are fully opaque, don't bother trying to blend them.
+    bool needsBlend = kEnableBlend
+                      && (__builtin_nyuzi_mask_cmpf_lt(color[kColorA], vecf16_t(1.0f)) & mask) != 0;
+    if (colorBuffer->getFormat() != Surface::kRGBA8888)
+    {
+        // Other formats are converted by the surface, and blended in
+        // floating point.
+        if (needsBlend)
+        {
+            vecf16_t destColor[4];
+            colorBuffer->unpackPixels(colorBuffer->readBlock(left, top), destColor);
+            vecf16_t oneMinusAlpha = 1.0f - clamp(color[kColorA], 0.0f, 1.0f);
+            for (int channel = 0; channel < 3; channel++)
+                color[channel] += destColor[channel] * oneMinusAlpha;
+        }
+
+        colorBuffer->writeBlockMasked(left, top, mask, colorBuffer->packPixels(color));
+        return;
+    }
+
+    // Convert color channels to 8bpp
+    vecu16_t rS = __builtin_convertvector(clamp(color[kColorR], 0.0, 1.0) * 255.0f, vecu16_t);
+    vecu16_t gS = __builtin_convertvector(clamp(color[kColorG], 0.0, 1.0) * 255.0f, vecu16_t);
+    vecu16_t bS = __builtin_convertvector(clamp(color[kColorB], 0.0, 1.0) * 255.0f, vecu16_t);
+
+    vecu16_t pixelValues;
+    if (needsBlend)
+    {
+        vecu16_t aS = __builtin_convertvector(clamp(color[kColorA], 0.0, 1.0) * 255.0f, vecu16_t)
+                      & 0xff;
+        vecu16_t oneMinusAS = 255 - aS;
+
+        vecu16_t destColors = vecu16_t(colorBuffer->readBlock(left, top));
+        vecu16_t rD = destColors & 0xff;
+        vecu16_t gD = (destColors >> 8) & 0xff;
+        vecu16_t bD = (destColors >> 16) & 0xff;
+
+        // Premultiplied alpha
+        vecu16_t newR = saturate(((rS << 8) + (rD * oneMinusAS)) >> 8, 255);
+        vecu16_t newG = saturate(((gS << 8) + (gD * oneMinusAS)) >> 8, 255);
+        vecu16_t newB = saturate(((bS << 8) + (bD * oneMinusAS)) >> 8, 255);
+        pixelValues = 0xff000000 | newR | (newG << 8) | (newB << 16);
+    }
+    else
+        pixelValues = 0xff000000 | rS | (gS << 8) | (bS << 16);
+
+    colorBuffer->writeBlockMasked(left, top, mask, vecu16_t(pixelValues));
+}
+
+template <typename ShaderType, int kNumParams>
+FillFunction TriangleFiller::selectFillFunction(const RenderState &state, bool perspective)
+{
+    static const FillFunction kFunctions[16] =
+    {
+        &fillBlock<ShaderType, false, false, false, false, kNumParams>,
+        &fillBlock<ShaderType, false, false, true, false, kNumParams>,
+        &fillBlock<ShaderType, false, true, false, false, kNumParams>,
+        &fillBlock<ShaderType, false, true, true, false, kNumParams>,
+        &fillBlock<ShaderType, true, false, false, false, kNumParams>,
+        &fillBlock<ShaderType, true, false, true, false, kNumParams>,
+        &fillBlock<ShaderType, true, true, false, false, kNumParams>,
+        &fillBlock<ShaderType, true, true, true, false, kNumParams>,
+        &fillBlock<ShaderType, false, false, false, true, kNumParams>,
+        &fillBlock<ShaderType, false, false, true, true, kNumParams>,
+        &fillBlock<ShaderType, false, true, false, true, kNumParams>,
+        &fillBlock<ShaderType, false, true, true, true, kNumParams>,
+        &fillBlock<ShaderType, true, false, false, true, kNumParams>,
+        &fillBlock<ShaderType, true, false, true, true, kNumParams>,
+        &fillBlock<ShaderType, true, true, false, true, kNumParams>,
+        &fillBlock<ShaderType, true, true, true, true, kNumParams>
+    };
+
+    return kFunctions[(state.fOcclusionQuery ? 8 : 0) + (state.fEnableDepthBuffer ? 4 : 0)
+                      + (state.fEnableBlend ? 2 : 0) + (perspective ? 1 : 0)];
+}
+
 } // namespace librender
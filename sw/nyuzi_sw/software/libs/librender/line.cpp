@@ -14,7 +14,9 @@
 // limitations under the License.
 //
 
+#include <assert.h>
 #include "line.h"
+#include "SIMDMath.h"
 
 namespace librender
 {
@@ -55,6 +57,81 @@ inline unsigned int clipmask(int x, int y, int left, int top, int right, int bot
     return mask;
 }
 
+// Lane offsets within a 4x4 block, in the order writeBlockMasked expects
+const veci16_t kXStep = { 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3 };
+const veci16_t kYStep = { 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3 };
+
+// The vector line functions find the minor axis coordinate of the line at
+// each major axis coordinate, in 16.16 fixed point relative to the first
+// endpoint so large coordinates don't overflow, and light the pixel it
+// rounds to. Each 4 pixel step along the major axis crosses at most two
+// blocks along the minor axis, so the line is drawn with one or two masked
+// block writes per step. x1 <= x2 for lines with a horizontal major axis, and
+// y1 <= y2 for lines with a vertical one.
+void drawHorizontalMajorBlocks(Surface *dest, int x1, int y1, int x2, int y2,
+                               vecu16_t color, int left, int top, int right, int bottom)
+{
+    int xStart = max(x1, left);
+    int xEnd = min(x2, right);
+    if (xStart > xEnd)
+        return;
+
+    int slope = x2 == x1 ? 0 : (y2 - y1) * 65536 / (x2 - x1);
+    int yBase = y1 * 65536 + 0x8000;
+    for (int blockX = xStart & ~3; blockX <= xEnd; blockX += 4)
+    {
+        int yFirst = ((max(blockX, xStart) - x1) * slope + yBase) >> 16;
+        int yLast = ((min(blockX + 3, xEnd) - x1) * slope + yBase) >> 16;
+        int minY = max(min(yFirst, yLast), top);
+        int maxY = min(max(yFirst, yLast), bottom);
+        veci16_t x = kXStep + blockX;
+        veci16_t lineY = ((x - x1) * slope + yBase) >> 16;
+        int columnMask = __builtin_nyuzi_mask_cmpi_sge(x, xStart)
+                         & __builtin_nyuzi_mask_cmpi_sle(x, xEnd);
+        for (int blockY = minY & ~3; blockY <= maxY; blockY += 4)
+        {
+            veci16_t y = kYStep + blockY;
+            int mask = columnMask & __builtin_nyuzi_mask_cmpi_eq(y, lineY)
+                       & __builtin_nyuzi_mask_cmpi_sge(y, top)
+                       & __builtin_nyuzi_mask_cmpi_sle(y, bottom);
+            if (mask)
+                dest->writeBlockMasked(blockX, blockY, static_cast<vmask_t>(mask), color);
+        }
+    }
+}
+
+void drawVerticalMajorBlocks(Surface *dest, int x1, int y1, int x2, int y2,
+                             vecu16_t color, int left, int top, int right, int bottom)
+{
+    int yStart = max(y1, top);
+    int yEnd = min(y2, bottom);
+    if (yStart > yEnd)
+        return;
+
+    int slope = y2 == y1 ? 0 : (x2 - x1) * 65536 / (y2 - y1);
+    int xBase = x1 * 65536 + 0x8000;
+    for (int blockY = yStart & ~3; blockY <= yEnd; blockY += 4)
+    {
+        int xFirst = ((max(blockY, yStart) - y1) * slope + xBase) >> 16;
+        int xLast = ((min(blockY + 3, yEnd) - y1) * slope + xBase) >> 16;
+        int minX = max(min(xFirst, xLast), left);
+        int maxX = min(max(xFirst, xLast), right);
+        veci16_t y = kYStep + blockY;
+        veci16_t lineX = ((y - y1) * slope + xBase) >> 16;
+        int rowMask = __builtin_nyuzi_mask_cmpi_sge(y, yStart)
+                      & __builtin_nyuzi_mask_cmpi_sle(y, yEnd);
+        for (int blockX = minX & ~3; blockX <= maxX; blockX += 4)
+        {
+            veci16_t x = kXStep + blockX;
+            int mask = rowMask & __builtin_nyuzi_mask_cmpi_eq(x, lineX)
+                       & __builtin_nyuzi_mask_cmpi_sge(x, left)
+                       & __builtin_nyuzi_mask_cmpi_sle(x, right);
+            if (mask)
+                dest->writeBlockMasked(blockX, blockY, static_cast<vmask_t>(mask), color);
+        }
+    }
+}
+
 } // namespace
 
 // Cohen/Sutherland line clipping
@@ -139,6 +216,7 @@ void drawLine(Surface *dest, int x1, int y1, int x2, int y2, unsigned int color)
     int deltaX = x2 > x1 ? (x2 - x1) + 1 : (x1 - x2) + 1;
     int xDir = x2 > x1 ? 1 : -1;
     int error = 0;
+    assert(dest->getLayout() == Surface::kLinear && dest->getBytesPerPixel() == 4);
     unsigned int *ptr = (static_cast<unsigned int*>(dest->bits())) + x1 + y1 * dest->getWidth();
     int stride = dest->getWidth();
 
@@ -199,5 +277,26 @@ void drawLine(Surface *dest, int x1, int y1, int x2, int y2, unsigned int color)
     }
 }
 
-} // namespace librender
+void drawLineBlocksClipped(Surface *dest, int x1, int y1, int x2, int y2, unsigned int color,
+                           int left, int top, int right, int bottom)
+{
+    vecu16_t colorVector = color;
+    int deltaX = x2 > x1 ? x2 - x1 : x1 - x2;
+    int deltaY = y2 > y1 ? y2 - y1 : y1 - y2;
+    if (deltaX >= deltaY)
+    {
+        if (x1 <= x2)
+            drawHorizontalMajorBlocks(dest, x1, y1, x2, y2, colorVector, left, top, right, bottom);
+        else
+            drawHorizontalMajorBlocks(dest, x2, y2, x1, y1, colorVector, left, top, right, bottom);
+    }
+    else
+    {
+        if (y1 <= y2)
+            drawVerticalMajorBlocks(dest, x1, y1, x2, y2, colorVector, left, top, right, bottom);
+        else
+            drawVerticalMajorBlocks(dest, x2, y2, x1, y1, colorVector, left, top, right, bottom);
+    }
+}
 
+} // namespace librender
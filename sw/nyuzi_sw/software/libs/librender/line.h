@@ -26,4 +26,14 @@ void drawLineClipped(Surface *dest, int x1, int y1, int x2, int y2, unsigned int
                      int left, int top, int right, int bottom);
 void drawLine(Surface *dest, int x1, int y1, int x2, int y2, unsigned int color);
 
+// Draw the part of a line that is inside the clip rectangle, which must be
+// within the surface. Rather than stepping one pixel at a time, this
+// computes which pixels of each 4x4 block the line covers with vector
+// operations, and writes them with Surface::writeBlockMasked. It works with
+// any surface layout and pixel format, and the clip rectangle only limits
+// how far along the line it walks, so lines that extend far outside it are
+// cheap.
+void drawLineBlocksClipped(Surface *dest, int x1, int y1, int x2, int y2, unsigned int color,
+                           int left, int top, int right, int bottom);
+
 } // namespace librender